@@ -1,14 +1,174 @@
 #pragma once
 
 
+#include <string>
+#include <vector>
 #include "stream/StreamSource.h"
 
 
 namespace live555client {
 
 
+/// 订阅过滤条件, 在收流线程组帧之前判断, 没有订阅者需要的帧不会分配 CFrame
+/// 注意: 对 H264 的 P 帧抽帧会导致无法解码, everyNth/maxFps 一般和 keyFrameOnly 一起使用
+/// 音频帧只受 keyFrameOnly 影响 (不投递), 不参与抽帧
+struct FrameFilter
+{
+    bool    keyFrameOnly;   ///< 只要 I 帧 (JPEG 的每一帧都算 I 帧)
+    int     everyNth;       ///< 每 N 帧取 1 帧, <= 1 表示不抽帧
+    int     maxFps;         ///< 最大帧率, <= 0 表示不限制
+
+    FrameFilter() : keyFrameOnly(false), everyNth(0), maxFps(0) {}
+};
+
+
+/// 收流线程的 CPU/NUMA 放置和调度优先级
+struct ThreadPlacement
+{
+    std::vector<int> cpus;      ///< 绑定的 CPU 列表, 空表示不绑定
+    int     numaNode;           ///< 收流线程的内存策略优先使用的 NUMA 节点, -1 表示取 cpus 里第一个 CPU 所在的节点
+                                ///< 只影响收流线程启动后自己首次分配的内存 (live555 对象, 接收缓冲, 由它扩容的帧内存池);
+                                ///< 应用预先分配好的帧内存池 (CPacketFactory::addPool) 不会被迁移
+    int     realtimePriority;   ///< > 0 时使用 SCHED_RR 实时优先级 (需要 CAP_SYS_NICE)
+    int     niceValue;          ///< 非实时调度时的 nice 值, 0 表示不修改
+
+    ThreadPlacement() : numaNode(-1), realtimePriority(0), niceValue(0) {}
+};
+
+
+/// 创建 rtsp 流的选项
+/// rtsps:// url 走 TLS (默认端口 322), 媒体数据固定使用 RTP over RTSP(TCP), 一起加密; 不支持 SRTP
+/// rtsps 需要以 LIVE555CLIENT_WITH_RTSPS (默认打开, 依赖 OpenSSL 1.1 以上) 编译, 否则打开失败
+struct RtspStreamOptions
+{
+    bool    streamUsingTcp;     ///< 使用 RTP over RTSP(TCP); 否则先用 UDP, 服务端不支持(461)时再用 TCP
+    bool    shareConnection;    ///< 同一 host:port 和用户名密码的流共用一条 rtsp 连接 (TCP 模式下媒体数据也走这条连接)
+    bool    shareStream;        ///< url (含用户名密码) 和影响会话的选项都相同的流共用一个会话, 帧分发给所有订阅者;
+                                ///< 同一 url 的选项不同时另开一个会话 (打印警告); 回放下载不共用
+    ThreadPlacement placement;  ///< 收流线程放置, 共用连接时以创建连接的第一路流为准
+    bool    dropCorruptFrames;  ///< RTP 丢包后丢弃缺包的帧和依赖它的 P 帧, 直到下一个完整的 IDR
+    bool    autoRequestKeyFrame;        ///< 检测到丢包和有新订阅者时, 自动通过 RTCP 请求关键帧
+    bool    keyFrameRequestFir;         ///< 请求关键帧发 FIR (RFC 5104), 否则发 PLI (RFC 4585)
+    int     keyFrameRequestIntervalMs;  ///< 两次请求关键帧的最小间隔
+    int     noFrameTimeoutMs;       ///< 超过该时间没有收到帧就重新打开这路流
+    int     reconnectDelayMs;       ///< 连接或这路流失败后第一次重试前的等待, 之后每次加倍, 到 4 倍后从头开始
+    int     keepAliveIntervalMs;    ///< 发送 GET_PARAMETER 保活的间隔, <= 0 表示不发 (只靠 RTCP 保活)
+    bool    onDemand;           ///< 按需收流: start() 后有订阅者才建立会话, 最后一个订阅断开 idleTimeoutMs 后关闭会话
+    int     idleTimeoutMs;      ///< 按需收流时没有订阅者后保持会话的时间
+    std::string archiveStart;   ///< 回放下载的开始时间 (UTC, 如 "20240101T080000Z"), 不为空时为回放下载模式:
+                                ///< 使用独立的 TCP 连接, 不共用流, 放完后停止 (不重连)
+    std::string archiveEnd;     ///< 回放下载的结束时间, 空表示到录像结束
+    float   archiveSpeed;       ///< 回放下载请求的发送倍速 (Speed 头), <= 0 表示不发; 同时会发 "Rate-Control: no" 请求不限速
+                                ///< 默认的 16 是一个保守的上限, 不是服务端支持的最大倍速; 服务端支持时可以调大,
+                                ///< 超过服务端能力的倍速一般会被降到它的上限 (以服务端为准), 实际速率见 getStats().throughputKbps
+    float   archiveScale;       ///< 回放的 Scale, 1 表示正常时间轴; 大于 1 时服务端一般只发关键帧
+    int     audioBatchMs;       ///< 把该时长内的音频包合并成一帧输出, 降低回调次数; <= 0 表示每包一帧
+    bool    tlsVerifyPeer;      ///< rtsps 校验服务端证书和主机名
+    std::string tlsCaFile;      ///< 校验证书用的 CA 文件 (PEM), 空表示使用系统默认的 CA
+    bool    tlsKernelOffload;   ///< rtsps 只协商 TLS 1.2, 以便内核 TLS (kTLS) 接管加解密;
+                                ///< 否则只有协商出 TLS 1.2 且内核支持时才使用 kTLS, 其它情况由转发线程加解密
+                                ///< kTLS 需要 OpenSSL 3 (打开 ktls 编译); 更早的 OpenSSL 忽略这个选项, 总是由转发线程加解密
+
+    RtspStreamOptions()
+        : streamUsingTcp(false), shareConnection(false), shareStream(false), dropCorruptFrames(false)
+        , autoRequestKeyFrame(false), keyFrameRequestFir(false), keyFrameRequestIntervalMs(1000)
+        , noFrameTimeoutMs(5000), reconnectDelayMs(2000), keepAliveIntervalMs(0), onDemand(false), idleTimeoutMs(10000)
+        , archiveSpeed(16.0f), archiveScale(1.0f), audioBatchMs(0), tlsVerifyPeer(true), tlsKernelOffload(false) {}
+};
+
+
+/// 流统计
+struct RtspStreamStats
+{
+    uint64_t    packetsLost;    ///< RTP 丢包数
+    uint64_t    corruptFrames;  ///< 检测到缺包的帧数
+    uint64_t    droppedFrames;  ///< 因缺包或等待 IDR 丢弃的帧数
+    uint64_t    keyFrameRequests;   ///< 发出的 RTCP PLI/FIR 数
+    uint64_t    bytesReceived;  ///< 收到的媒体数据字节数
+    double      throughputKbps; ///< 和上一次 getStats() 之间的平均接收速率
+    bool        archiveFinished;    ///< 回放下载已经放完
+
+    RtspStreamStats()
+        : packetsLost(0), corruptFrames(0), droppedFrames(0), keyFrameRequests(0)
+        , bytesReceived(0), throughputKbps(0), archiveFinished(false) {}
+};
+
+
+/// rtsp 流扩展接口, createRtspStream() 返回的流都实现了这个接口
+class IRtspStreamSource : public stream::IStreamSource
+{
+public:
+    using stream::IStreamSource::connect;
+
+    /// 带过滤条件订阅
+    virtual Connection connect(StreamCallback callback, FrameFilter const& filter) = 0;
+
+    /// 取统计
+    virtual RtspStreamStats getStats() = 0;
+
+    /// 通过 RTCP PLI/FIR 请求关键帧, 异步发送, 受 keyFrameRequestIntervalMs 限速
+    /// 流正在收流 (有会话) 时返回 true, 否则请求留到会话建立后发送, 返回 false; 实际发出的个数见 getStats().keyFrameRequests
+    virtual bool requestKeyFrame() = 0;
+
+    /// 回放下载的流控: 消费者处理不过来时设为 true, 收流线程暂停读取, 服务端由 TCP 窗口降速; 对直播流无效
+    virtual void setConsumerBusy(bool busy) = 0;
+};
+
+
+/// 多码流自动切换策略: 任一指标超过上限时切到下一个 (更低的) 码流, 全部低于下限时切回上一个
+struct ProfilePolicy
+{
+    bool    enabled;            ///< 自动切换, 否则只通过 setProfile() 切换
+    int     cpuHighPercent;     ///< 整机 CPU 使用率上限
+    int     cpuLowPercent;      ///< 整机 CPU 使用率下限
+    int     queueHigh;          ///< reportQueueDepth() 上报的消费者队列深度上限, <= 0 表示不看队列
+    int     queueLow;           ///< 消费者队列深度下限
+    int     holdMs;             ///< 两次切换的最小间隔, 防止来回切换
+
+    ProfilePolicy()
+        : enabled(false), cpuHighPercent(85), cpuLowPercent(60), queueHigh(0), queueLow(0), holdMs(30000) {}
+};
+
+
+/// 多码流的 rtsp 流, createRtspProfileStream() 返回的流实现了这个接口
+/// 码流按 url 列表的顺序排列, 0 是最高的; 切换时新码流先开始收流, 到它的 I 帧才切换输出, 订阅者不会断流
+/// getStats()/requestKeyFrame() 针对当前输出的码流
+class IRtspProfileStreamSource : public IRtspStreamSource
+{
+public:
+    /// 码流个数
+    virtual int profileCount() = 0;
+
+    /// 当前输出的码流
+    virtual int currentProfile() = 0;
+
+    /// 切换到 index, 在它的下一个 I 帧处生效; 自动策略在 holdMs 之内不会再切换
+    virtual void setProfile(int index) = 0;
+
+    /// 上报消费者 (如解码) 的队列深度, 供自动策略使用
+    virtual void reportQueueDepth(int depth) = 0;
+};
+
+
 stream::IStreamSourcePtr createRtspStream(char const* url, char const* username = NULL, char const* password = NULL);
 
+stream::IStreamSourcePtr createRtspStream(char const* url, char const* username, char const* password,
+                                          RtspStreamOptions const& options);
+
+/// 创建多码流的 rtsp 流, urls 从高到低排列, 所有码流使用相同的用户名密码和选项
+stream::IStreamSourcePtr createRtspProfileStream(std::vector<std::string> const& urls, char const* username, char const* password,
+                                                 RtspStreamOptions const& options, ProfilePolicy const& policy = ProfilePolicy());
+
+/// 取 rtsp 流扩展接口, source 不是 createRtspStream() 创建的返回 NULL
+IRtspStreamSource* toRtspStream(stream::IStreamSourcePtr const& source);
+
+/// 取多码流接口, source 不是 createRtspProfileStream() 创建的返回 NULL
+IRtspProfileStreamSource* toRtspProfileStream(stream::IStreamSourcePtr const& source);
+
+/// 设置运行时日志级别: 0 trace, 1 info, 2 warn, 3 error, 4 不输出; 默认为编译期的 RTSP_LOG_MIN_LEVEL (info),
+/// 编译期去掉的日志不会因此输出; trace 时之后建立的连接会输出 live555 的 rtsp 请求应答和 SDP (异步, 不阻塞收流)
+void setLogLevel(int level);
+
 
 } // namespace
 
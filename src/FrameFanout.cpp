@@ -0,0 +1,150 @@
+
+#include "FrameFanout.h"
+
+
+namespace live555client {
+
+
+CFrameFanout::Connection CFrameFanout::connect(StreamCallback callback)
+{
+    return mSignal.connect(callback);
+}
+
+CFrameFanout::Connection CFrameFanout::connect(StreamCallback callback, FrameFilter const& filter)
+{
+    return connect(callback, filter, WantedCallback());
+}
+
+CFrameFanout::Connection CFrameFanout::connect(StreamCallback callback, FrameFilter const& filter, WantedCallback wanted)
+{
+    SubscriberPtr subscriber(new Subscriber(filter, wanted));
+    auto connection = subscriber->signal.connect(callback);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSubscribers.push_back(subscriber);
+    return connection;
+}
+
+bool CFrameFanout::Subscriber::accept(char frametype, uint64_t pts)
+{
+    if (wanted && !wanted(frametype, pts)) {
+        return false;
+    }
+
+    if (filter.keyFrameOnly && frametype != 'I') {
+        return false;
+    }
+
+    if (frametype == 'A') {
+        // audio doesn't take part in frame sampling
+        return true;
+    }
+
+    if (filter.everyNth > 1 && (counter % filter.everyNth) != 0) {
+        ++counter;
+        return false;
+    }
+
+    if (filter.maxFps > 0) {
+        uint64_t interval = 1000 / filter.maxFps;
+        if (lastPts != 0 && pts >= lastPts && pts - lastPts < interval) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void CFrameFanout::Subscriber::commit()
+{
+    if (filter.everyNth > 1) {
+        ++counter;
+    }
+    lastPts = acceptedPts;
+}
+
+bool CFrameFanout::wanted(char frametype, uint64_t pts)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    bool wanted = !mSignal.empty();
+
+    for (auto it = mSubscribers.begin(); it != mSubscribers.end(); ) {
+        auto& subscriber = *it;
+        if (subscriber->signal.empty()) {
+            // connection released
+            it = mSubscribers.erase(it);
+            continue;
+        }
+
+        bool accepted = subscriber->accept(frametype, pts);
+        if (frametype == 'A') {
+            subscriber->accepted[MEDIA_AUDIO] = accepted;
+        } else {
+            subscriber->accepted[MEDIA_VIDEO] = accepted;
+            subscriber->acceptedPts = pts;
+        }
+        wanted = wanted || accepted;
+        ++it;
+    }
+
+    return wanted;
+}
+
+bool CFrameFanout::mayWant(char frametype)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mSignal.empty()) {
+        return true;
+    }
+
+    for (auto& subscriber : mSubscribers) {
+        if (!subscriber->signal.empty() && (!subscriber->filter.keyFrameOnly || frametype == 'I')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void CFrameFanout::deliver(stream::CFrame const& frame)
+{
+    mSignal(frame);
+
+    auto info = frame.info();
+    int media = (info != NULL && info->type == stream::STREAM_AUDIO) ? MEDIA_AUDIO : MEDIA_VIDEO;
+
+    std::vector<SubscriberPtr> accepted;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (auto& subscriber : mSubscribers) {
+            if (subscriber->accepted[media]) {
+                subscriber->accepted[media] = false;
+                if (media == MEDIA_VIDEO) {
+                    subscriber->commit();
+                }
+                accepted.push_back(subscriber);
+            }
+        }
+    }
+
+    for (auto& subscriber : accepted) {
+        subscriber->signal(frame);
+    }
+}
+
+bool CFrameFanout::empty()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mSignal.empty()) {
+        return false;
+    }
+
+    for (auto& subscriber : mSubscribers) {
+        if (!subscriber->signal.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+} // namespace live555client
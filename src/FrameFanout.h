@@ -0,0 +1,87 @@
+#ifndef __APP_RTSP_CLIENT_FRAME_FANOUT_H__
+#define __APP_RTSP_CLIENT_FRAME_FANOUT_H__
+
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "stream/StreamSource.h"
+#include "live555client/Live555Client.h"
+
+
+namespace live555client {
+
+
+/// 把一路帧分发给所有订阅者, 带过滤条件的订阅者在组帧之前判断要不要
+class CFrameFanout
+{
+public:
+    typedef stream::IStreamSource::StreamCallback StreamCallback;
+    typedef stream::IStreamSource::Signal Signal;
+    typedef stream::IStreamSource::Connection Connection;
+    typedef wize::function<bool(char frametype, uint64_t pts)> WantedCallback;
+
+    CFrameFanout() {}
+
+    Connection connect(StreamCallback callback);
+
+    Connection connect(StreamCallback callback, FrameFilter const& filter);
+
+    /// 带过滤条件订阅, 另外在过滤条件之前由 wanted 判断要不要, 在收流线程里调用
+    Connection connect(StreamCallback callback, FrameFilter const& filter, WantedCallback wanted);
+
+    /// 组帧之前调用, 有订阅者要这一帧返回 true; 之后的 deliver() 只投递给要这一帧的订阅者
+    /// 视频和音频的判断分开保存, 一个视频帧组帧期间可以插入音频帧的 wanted()/deliver()
+    /// 抽帧状态在 deliver() 时才更新, wanted() 之后被丢弃 (没有 deliver) 的帧不占抽帧名额
+    bool wanted(char frametype, uint64_t pts);
+
+    /// 有订阅者可能要这种帧, 不改变抽帧状态; 用于转发给别的 fanout 之前的粗判
+    bool mayWant(char frametype);
+
+    /// 投递帧, 在 wanted() 之后调用
+    void deliver(stream::CFrame const& frame);
+
+    /// 没有订阅者 (订阅都已释放)
+    bool empty();
+
+private:
+    CFrameFanout(CFrameFanout const&);
+    CFrameFanout& operator=(CFrameFanout const&);
+
+    enum { MEDIA_VIDEO, MEDIA_AUDIO, MEDIA_COUNT };
+
+    /// 带过滤条件的订阅者
+    struct Subscriber
+    {
+        FrameFilter filter;
+        WantedCallback wanted;
+        Signal      signal;
+        int         counter;    ///< everyNth 计数
+        uint64_t    lastPts;    ///< 上一个投递的视频帧的 pts, maxFps 用
+        bool        accepted[MEDIA_COUNT];  ///< 已经 wanted() 还没 deliver() 的视频帧/音频帧是否要投递
+        uint64_t    acceptedPts;    ///< 要投递的视频帧的 pts
+
+        Subscriber(FrameFilter const& f, WantedCallback const& w)
+            : filter(f), wanted(w), counter(0), lastPts(0), acceptedPts(0)
+        {
+            accepted[MEDIA_VIDEO] = accepted[MEDIA_AUDIO] = false;
+        }
+
+        /// 判断要不要, 只有抽帧跳过的帧在这里计数
+        bool accept(char frametype, uint64_t pts);
+
+        /// 视频帧投递了, 更新抽帧状态
+        void commit();
+    };
+    typedef std::shared_ptr<Subscriber> SubscriberPtr;
+
+private:
+    Signal              mSignal;
+    std::mutex          mMutex;
+    std::vector<SubscriberPtr> mSubscribers;
+};
+
+
+} // namespace live555client
+
+#endif // __APP_RTSP_CLIENT_FRAME_FANOUT_H__
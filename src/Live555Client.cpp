@@ -1,32 +1,90 @@
 
+#include "RtspLog.h"
+#include "RtspProfileStream.h"
 #include "RtspStream.h"
 #include "live555client/Live555Client.h"
 
 
 namespace live555client {
 
+namespace {
+
+/// 把用户名密码加到 url 里
+bool fullUrl(char const* url, char const* username, char const* password, std::string& full_url)
+{
+    if (username == NULL || password == NULL) {
+        full_url = url;
+        return true;
+    }
+
+    auto p = strstr(url, "://");
+    if (p == NULL) {
+        rtspErrorf(NULL, "invalid url!\n");
+        return false;
+    }
+
+    p += 3;
+    full_url.assign(url, p);
+    full_url += username;   // FIXME: url encode
+    full_url += ":";
+    full_url += password;   // FIXME: url encode
+    full_url += "@";
+    full_url += p;
+    return true;
+}
+
+} // namespace
+
 stream::IStreamSourcePtr createRtspStream(char const* url, char const* username, char const* password)
+{
+    return createRtspStream(url, username, password, RtspStreamOptions());
+}
+
+stream::IStreamSourcePtr createRtspStream(char const* url, char const* username, char const* password,
+                                          RtspStreamOptions const& options)
 {
     std::string full_url;
-    if (username != NULL && password != NULL) {
-        auto p = strstr(url, "://");
-        if (p == NULL) {
-            errorf("invalid url!\n");
+    if (!fullUrl(url, username, password, full_url)) {
+        return stream::IStreamSourcePtr();
+    }
+
+    rtspTracef(NULL, "url(%s)\n", full_url.c_str());
+    return CRtspStreamHandle::create(full_url.c_str(), options);
+}
+
+stream::IStreamSourcePtr createRtspProfileStream(std::vector<std::string> const& urls, char const* username, char const* password,
+                                                 RtspStreamOptions const& options, ProfilePolicy const& policy)
+{
+    if (urls.empty()) {
+        rtspErrorf(NULL, "no url!\n");
+        return stream::IStreamSourcePtr();
+    }
+
+    std::vector<stream::IStreamSourcePtr> profiles;
+    for (auto& url : urls) {
+        auto profile = createRtspStream(url.c_str(), username, password, options);
+        if (!profile) {
             return stream::IStreamSourcePtr();
         }
-
-        p += 3;
-        full_url.assign(url, p);
-        full_url += username;   // FIXME: url encode
-        full_url += ":";
-        full_url += password;   // FIXME: url encode
-        full_url += "@";
-        full_url += p;
-        url = full_url.c_str();
+        profiles.push_back(profile);
     }
 
-    tracef("url(%s)\n", url);
-    return stream::IStreamSourcePtr(new CRtspStreamSource(url));
+    return stream::IStreamSourcePtr(new CRtspProfileStream(profiles, options, policy));
+}
+
+IRtspStreamSource* toRtspStream(stream::IStreamSourcePtr const& source)
+{
+    return dynamic_cast<IRtspStreamSource*>(source.get());
+}
+
+IRtspProfileStreamSource* toRtspProfileStream(stream::IStreamSourcePtr const& source)
+{
+    return dynamic_cast<IRtspProfileStreamSource*>(source.get());
+}
+
+void setLogLevel(int level)
+{
+    rtspSetLogLevel(level);
 }
 
 }
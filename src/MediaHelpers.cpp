@@ -0,0 +1,151 @@
+#include <string.h>
+#include "MediaHelpers.h"
+
+
+namespace live555client {
+
+
+namespace {
+
+enum {
+    NAL_TYPE_SEI = 6,
+    NAL_TYPE_SPS = 7,
+    NAL_TYPE_PPS = 8,
+};
+
+uint8_t const START_CODE[] = { 0x00, 0x00, 0x00, 0x01 };
+
+uint8_t* putU32(uint8_t* ptr, uint32_t v)
+{
+    *ptr++ = (uint8_t)(v >> 24);
+    *ptr++ = (uint8_t)(v >> 16);
+    *ptr++ = (uint8_t)(v >> 8);
+    *ptr++ = (uint8_t)v;
+    return ptr;
+}
+
+} // namespace
+
+
+size_t buildKeyFrameRequest(uint8_t* buf, uint32_t senderSsrc, uint32_t mediaSsrc, bool fir, uint8_t firSequence)
+{
+    uint8_t* ptr = buf;
+
+    ptr = putU32(ptr, 0x80000000 | (201 << 16) | 1);    // V=2, RC=0, PT=RR, length=1
+    ptr = putU32(ptr, senderSsrc);
+
+    if (fir) {
+        ptr = putU32(ptr, 0x80000000 | (4 << 24) | (206 << 16) | 4);    // V=2, FMT=4, PT=PSFB, length=4
+        ptr = putU32(ptr, senderSsrc);
+        ptr = putU32(ptr, 0);                           // FIR 不用 media source SSRC
+        ptr = putU32(ptr, mediaSsrc);                   // FCI: SSRC, 命令序号, 保留
+        ptr = putU32(ptr, (uint32_t)firSequence << 24);
+    } else {
+        ptr = putU32(ptr, 0x80000000 | (1 << 24) | (206 << 16) | 2);    // V=2, FMT=1, PT=PSFB, length=2
+        ptr = putU32(ptr, senderSsrc);
+        ptr = putU32(ptr, mediaSsrc);
+    }
+
+    return ptr - buf;
+}
+
+uint8_t aacFrequencyIndex(unsigned sampleRate)
+{
+    static unsigned const frequencies[] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350 };
+    for (uint8_t i = 0; i < sizeof(frequencies) / sizeof(frequencies[0]); ++i) {
+        if (frequencies[i] == sampleRate) {
+            return i;
+        }
+    }
+    return 15;
+}
+
+bool parseAacConfig(uint8_t const* data, size_t size, AacConfig& config)
+{
+    if (data == NULL || size < 2) {
+        return false;
+    }
+
+    uint8_t objectType = data[0] >> 3;
+    uint8_t frequencyIndex = ((data[0] & 0x07) << 1) | (data[1] >> 7);
+    uint8_t channelConfig = (data[1] >> 3) & 0x0f;
+
+    if (objectType >= 1 && objectType <= 4) {
+        // ADTS 只能携带这几种
+        config.profile = objectType - 1;
+    }
+    if (frequencyIndex != 15) {
+        config.frequencyIndex = frequencyIndex;
+    }
+    if (channelConfig != 0) {
+        config.channelConfig = channelConfig;
+    }
+    return true;
+}
+
+bool buildAdtsHeader(uint8_t* header, AacConfig const& config, unsigned frameSize)
+{
+    if (frameSize > ADTS_MAX_FRAME_SIZE - ADTS_HEADER_SIZE) {
+        return false;
+    }
+
+    unsigned length = ADTS_HEADER_SIZE + frameSize;
+    header[0] = 0xFF;
+    header[1] = 0xF1;   // MPEG-4, layer 0, 不带 CRC
+    header[2] = (uint8_t)((config.profile << 6) | (config.frequencyIndex << 2) | (config.channelConfig >> 2));
+    header[3] = (uint8_t)(((config.channelConfig & 0x03) << 6) | (length >> 11));
+    header[4] = (uint8_t)((length >> 3) & 0xFF);
+    header[5] = (uint8_t)(((length & 0x07) << 5) | 0x1F);  // buffer fullness 0x7FF: 可变码率
+    header[6] = 0xFC;
+    return true;
+}
+
+bool CH264ParameterSets::store(uint8_t const* nal, size_t size)
+{
+    if (size == 0) {
+        return false;
+    }
+
+    std::vector<uint8_t>* buffer;
+    switch (nal[0] & 0x1f) {
+    case NAL_TYPE_SPS: buffer = &mSps; break;
+    case NAL_TYPE_PPS: buffer = &mPps; break;
+    case NAL_TYPE_SEI: buffer = &mSei; break;
+    default: return false;
+    }
+
+    // assign 复用之前的容量, 每个 I 帧周期不再分配内存
+    buffer->assign(START_CODE, START_CODE + sizeof(START_CODE));
+    buffer->insert(buffer->end(), nal, nal + size);
+    return true;
+}
+
+size_t CH264ParameterSets::take(uint8_t* out)
+{
+    uint8_t* ptr = out;
+    std::vector<uint8_t>* buffers[] = { &mSps, &mPps, &mSei };
+    for (auto buffer : buffers) {
+        if (!buffer->empty()) {
+            memcpy(ptr, buffer->data(), buffer->size());
+            ptr += buffer->size();
+            buffer->clear();
+        }
+    }
+    return ptr - out;
+}
+
+bool CLossGate::pass(char frametype, bool lost, bool dropCorrupt)
+{
+    if (frametype == 'I') {
+        mWaitingKeyFrame = false;
+        return true;
+    }
+
+    if (lost && dropCorrupt) {
+        mWaitingKeyFrame = true;
+    }
+    return !mWaitingKeyFrame;
+}
+
+
+} // namespace live555client
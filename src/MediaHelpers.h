@@ -0,0 +1,88 @@
+#ifndef __APP_RTSP_CLIENT_MEDIA_HELPERS_H__
+#define __APP_RTSP_CLIENT_MEDIA_HELPERS_H__
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+namespace live555client {
+
+
+/// 关键帧请求 RTCP 包的最大长度
+enum { KEY_FRAME_REQUEST_MAX_SIZE = 28 };
+
+/// 组一个复合 RTCP 包: 空的 RR (RTCP 包必须以报告开头), 后面跟 PLI (RFC 4585 6.3.1) 或 FIR (RFC 5104 4.3.1)
+/// buf 至少 KEY_FRAME_REQUEST_MAX_SIZE 字节, 返回长度
+size_t buildKeyFrameRequest(uint8_t* buf, uint32_t senderSsrc, uint32_t mediaSsrc, bool fir, uint8_t firSequence);
+
+
+/// ADTS 头长度 (不带 CRC), 和 13 位长度字段能表示的最大帧长 (含头)
+enum { ADTS_HEADER_SIZE = 7, ADTS_MAX_FRAME_SIZE = 8191 };
+
+/// AAC 参数, 组 ADTS 头用
+struct AacConfig
+{
+    uint8_t profile;            ///< ADTS profile, 即 audio object type - 1
+    uint8_t frequencyIndex;     ///< 采样率索引, 15 表示没有对应的索引
+    uint8_t channelConfig;
+
+    AacConfig() : profile(1), frequencyIndex(15), channelConfig(0) {}
+};
+
+/// 采样率对应的 MPEG-4 采样率索引, 没有时返回 15
+uint8_t aacFrequencyIndex(unsigned sampleRate);
+
+/// 用 AudioSpecificConfig (SDP 的 "config=") 覆盖 config 里能从中得到的字段, ADTS 不能携带的 object type 保持原值
+/// 太短返回 false
+bool parseAacConfig(uint8_t const* data, size_t size, AacConfig& config);
+
+/// 组 ADTS 头, frameSize 是不带头的 AAC 帧长度; 加上头超过 ADTS_MAX_FRAME_SIZE 时不能用 ADTS 携带, 返回 false
+bool buildAdtsHeader(uint8_t* header, AacConfig const& config, unsigned frameSize);
+
+
+/// H264 参数集 (SPS/PPS/SEI) 缓存: 收到时保存, 拼到下一个输出的 IDR 前面
+/// 没人要的 IDR 不取走, 留给下一个要输出的 IDR
+class CH264ParameterSets
+{
+public:
+    /// 保存一个 nal (不带起始码), 同类型的覆盖之前的; 不是 SPS/PPS/SEI 返回 false
+    bool store(uint8_t const* nal, size_t size);
+
+    /// take() 要写出的长度
+    size_t size() const { return mSps.size() + mPps.size() + mSei.size(); }
+
+    /// 按 SPS, PPS, SEI 的顺序写出 (各带 4 字节起始码) 并清空, 返回写出的长度
+    size_t take(uint8_t* out);
+
+private:
+    std::vector<uint8_t> mSps;
+    std::vector<uint8_t> mPps;
+    std::vector<uint8_t> mSei;
+};
+
+
+/// 丢包后的丢帧判断: 打开 dropCorrupt 时, 丢包之后的帧都丢弃, 直到下一个 I 帧
+/// live555 只交出完整的 nal, 所以丢包影响的是之前的帧, I 帧总是可以输出
+class CLossGate
+{
+public:
+    CLossGate() : mWaitingKeyFrame(false) {}
+
+    /// 判断一帧是否输出, lost 表示这一帧之前有新的丢包
+    bool pass(char frametype, bool lost, bool dropCorrupt);
+
+    /// 在非帧数据 (参数集等) 之前发现丢包
+    void lost(bool dropCorrupt) { if (dropCorrupt) mWaitingKeyFrame = true; }
+
+    bool waitingKeyFrame() const { return mWaitingKeyFrame; }
+
+private:
+    bool mWaitingKeyFrame;
+};
+
+
+} // namespace live555client
+
+#endif // __APP_RTSP_CLIENT_MEDIA_HELPERS_H__
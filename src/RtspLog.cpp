@@ -0,0 +1,288 @@
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "wize/Log.h"
+#include "wize/LoopThread.h"
+#include "RtspLog.h"
+
+
+namespace live555client {
+
+
+namespace {
+
+
+std::atomic<int> logLevel(RTSP_LOG_MIN_LEVEL);
+
+
+uint64_t monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/// 单线程日志队列, 生产者是写日志的线程, 消费者是后台输出线程
+/// 两块缓冲交换使用: 生产者在锁外格式化, 锁内只复制一条; 消费者在锁内只交换缓冲
+class CLogQueue
+{
+public:
+    enum { CAPACITY = 256, ENTRY_SIZE = 512 };
+
+    struct Entry
+    {
+        int     level;
+        char    text[ENTRY_SIZE];
+    };
+
+    CLogQueue() : mDropped(0), mClosed(false)
+    {
+        mEntries.reserve(CAPACITY);
+    }
+
+    /// 队列满时丢弃这条日志
+    void push(Entry const& entry)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mEntries.size() >= CAPACITY) {
+            ++mDropped;
+            return;
+        }
+        mEntries.push_back(entry);
+    }
+
+    /// 取出所有日志, out 必须是空的 (它的空间换给生产者继续用); 返回 false 表示队列已关闭且取空, 可以删除
+    bool drain(std::vector<Entry>& out, unsigned& dropped)
+    {
+        out.reserve(CAPACITY);
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        mEntries.swap(out);
+        dropped = mDropped;
+        mDropped = 0;
+        return !mClosed;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mClosed = true;
+    }
+
+private:
+    std::mutex          mMutex;
+    unsigned            mDropped;
+    bool                mClosed;
+    std::vector<Entry>  mEntries;
+};
+typedef std::shared_ptr<CLogQueue> CLogQueuePtr;
+
+
+/// 后台输出线程, 定时把各线程队列里的日志写到 wize 日志
+class CRtspLogger : public wize::CLoopThread
+{
+public:
+    static CRtspLogger* instance()
+    {
+        // never deleted, logging threads may outlive static destruction
+        static CRtspLogger* logger = create();
+        return logger;
+    }
+
+    void attach(CLogQueuePtr const& queue)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQueues.push_back(queue);
+    }
+
+private:
+    CRtspLogger() : wize::CLoopThread("RtspLogger")
+    {
+        startThread();
+    }
+
+    static CRtspLogger* create()
+    {
+        CRtspLogger* logger = new CRtspLogger();
+        // the last messages before exit() (often the reason for it) would otherwise still be queued
+        atexit(flushAtExit);
+        return logger;
+    }
+
+    static void flushAtExit()
+    {
+        instance()->flush();
+    }
+
+    void threadProc()
+    {
+        do {
+            flush();
+        } while (waitSignal(50) != SIGNAL_EXIT);
+    }
+
+    /// 输出所有队列里的日志
+    void flush()
+    {
+        // serializes the logger thread and flushAtExit(), and keeps the order of each queue
+        std::lock_guard<std::mutex> outputLock(mOutputMutex);
+
+        std::vector<CLogQueuePtr> queues;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            queues = mQueues;
+        }
+
+        for (auto& queue : queues) {
+            unsigned dropped = 0;
+            if (!queue->drain(mEntries, dropped)) {
+                detach(queue);
+            }
+
+            for (auto& entry : mEntries) {
+                output(entry.level, entry.text);
+            }
+            mEntries.clear();
+
+            if (dropped > 0) {
+                warnf("rtsp log queue full, %u messages dropped\n", dropped);
+            }
+        }
+    }
+
+    void detach(CLogQueuePtr const& queue)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (auto it = mQueues.begin(); it != mQueues.end(); ++it) {
+            if (*it == queue) {
+                mQueues.erase(it);
+                break;
+            }
+        }
+    }
+
+    static void output(int level, char const* text)
+    {
+        switch (level) {
+        case RTSP_LOG_LEVEL_TRACE:  tracef("%s", text); break;
+        case RTSP_LOG_LEVEL_INFO:   infof("%s", text);  break;
+        case RTSP_LOG_LEVEL_WARN:   warnf("%s", text);  break;
+        default:                    errorf("%s", text); break;
+        }
+    }
+
+private:
+    std::mutex                  mMutex;
+    std::vector<CLogQueuePtr>   mQueues;
+    std::mutex                  mOutputMutex;
+    std::vector<CLogQueue::Entry> mEntries;     ///< 和各队列交换的缓冲
+};
+
+
+/// 线程退出时关闭队列, 由后台线程取空后释放
+struct CThreadLogQueue
+{
+    CLogQueuePtr queue;
+
+    CThreadLogQueue() : queue(new CLogQueue())
+    {
+        CRtspLogger::instance()->attach(queue);
+    }
+
+    ~CThreadLogQueue()
+    {
+        queue->close();
+    }
+};
+
+
+} // namespace
+
+
+CRtspLogLimiter::CRtspLogLimiter(int ratePerSecond, int burst)
+    : mRate(ratePerSecond)
+    , mBurst(burst)
+    , mTokens((int64_t)burst * 1000)
+    , mLastMs(monotonicMs())
+    , mSuppressed(0)
+{
+}
+
+bool CRtspLogLimiter::allow()
+{
+    uint64_t now = monotonicMs();
+    mTokens += (int64_t)(now - mLastMs) * mRate;
+    mLastMs = now;
+    if (mTokens > (int64_t)mBurst * 1000) {
+        mTokens = (int64_t)mBurst * 1000;
+    }
+
+    if (mTokens < 1000) {
+        ++mSuppressed;
+        return false;
+    }
+
+    mTokens -= 1000;
+    return true;
+}
+
+unsigned CRtspLogLimiter::takeSuppressed()
+{
+    unsigned suppressed = mSuppressed;
+    mSuppressed = 0;
+    return suppressed;
+}
+
+void rtspSetLogLevel(int level)
+{
+    logLevel = level;
+}
+
+int rtspLogLevel()
+{
+    return logLevel;
+}
+
+void rtspLogPrint(int level, CRtspLogLimiter* limiter, char const* fmt, ...)
+{
+    if (level < logLevel) {
+        return;
+    }
+    if (limiter != NULL && !limiter->allow()) {
+        return;
+    }
+
+    static thread_local CThreadLogQueue threadQueue;
+
+    // formatted on the stack, outside the queue's lock
+    CLogQueue::Entry entry;
+    int len = 0;
+    unsigned suppressed = limiter ? limiter->takeSuppressed() : 0;
+    if (suppressed > 0) {
+        len = snprintf(entry.text, sizeof(entry.text), "(%u suppressed) ", suppressed);
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    int needed = vsnprintf(entry.text + len, sizeof(entry.text) - len, fmt, ap);
+    va_end(ap);
+
+    if (needed >= (int)sizeof(entry.text) - len) {
+        // cut off, mark it (keeping the line break that most messages end with)
+        static char const mark[] = "...\n";
+        memcpy(entry.text + sizeof(entry.text) - sizeof(mark), mark, sizeof(mark));
+    }
+
+    entry.level = level;
+    threadQueue.queue->push(entry);
+}
+
+
+} // namespace live555client
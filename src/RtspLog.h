@@ -0,0 +1,72 @@
+#ifndef __APP_RTSP_CLIENT_LOG_H__
+#define __APP_RTSP_CLIENT_LOG_H__
+
+
+#include <stdint.h>
+
+
+#define RTSP_LOG_LEVEL_TRACE    0
+#define RTSP_LOG_LEVEL_INFO     1
+#define RTSP_LOG_LEVEL_WARN     2
+#define RTSP_LOG_LEVEL_ERROR    3
+#define RTSP_LOG_LEVEL_NONE     4
+
+/// 编译期最低日志级别, 低于这个级别的日志调用连参数都不会求值
+#ifndef RTSP_LOG_MIN_LEVEL
+#define RTSP_LOG_MIN_LEVEL RTSP_LOG_LEVEL_INFO
+#endif
+
+
+namespace live555client {
+
+
+/// 每路流一个的日志限速器 (令牌桶), 只在该流的事件循环线程里使用, 不加锁
+class CRtspLogLimiter
+{
+public:
+    CRtspLogLimiter(int ratePerSecond = 5, int burst = 20);
+
+    /// 是否允许输出, 不允许时累计丢弃条数
+    bool allow();
+
+    /// 取出并清零丢弃条数
+    unsigned takeSuppressed();
+
+private:
+    int         mRate;
+    int         mBurst;
+    int64_t     mTokens;        ///< 千分之一个令牌为单位
+    uint64_t    mLastMs;
+    unsigned    mSuppressed;
+};
+
+
+/// 运行时日志级别, 默认为 RTSP_LOG_MIN_LEVEL; 只能在编译期级别之上再过滤, 编译掉的日志不会因此输出
+void rtspSetLogLevel(int level);
+int rtspLogLevel();
+
+/// 格式化后放入当前线程的日志队列, 由后台线程异步输出; 低于运行时级别的丢弃; limiter 可以为 NULL
+void rtspLogPrint(int level, CRtspLogLimiter* limiter, char const* fmt, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 3, 4)))
+#endif
+    ;
+
+
+} // namespace live555client
+
+
+#define RTSP_LOG(level, limiter, ...) \
+    do { \
+        if ((level) >= RTSP_LOG_MIN_LEVEL) { \
+            ::live555client::rtspLogPrint((level), (limiter), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define rtspTracef(limiter, ...)    RTSP_LOG(RTSP_LOG_LEVEL_TRACE, limiter, __VA_ARGS__)
+#define rtspInfof(limiter, ...)     RTSP_LOG(RTSP_LOG_LEVEL_INFO, limiter, __VA_ARGS__)
+#define rtspWarnf(limiter, ...)     RTSP_LOG(RTSP_LOG_LEVEL_WARN, limiter, __VA_ARGS__)
+#define rtspErrorf(limiter, ...)    RTSP_LOG(RTSP_LOG_LEVEL_ERROR, limiter, __VA_ARGS__)
+
+
+#endif // __APP_RTSP_CLIENT_LOG_H__
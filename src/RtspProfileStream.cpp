@@ -0,0 +1,401 @@
+
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include "wize/LoopThread.h"
+#include "stream/EncodeSpecific.h"
+#include "RtspLog.h"
+#include "RtspStream.h"
+#include "RtspProfileStream.h"
+
+
+namespace live555client {
+
+
+namespace {
+
+
+/// 新码流超过该时间还没有 I 帧就放弃切换
+int const PENDING_TIMEOUT_MS = 10000;
+
+
+uint64_t monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// 帧类型: 'I', 'P', 音频为 'A'
+/// 组帧时 I 帧的 IDR 前面是 SPS/PPS/SEI, P 帧前面没有别的 nal
+char frameType(stream::CFrame const& frame)
+{
+    auto info = frame.info();
+    if (info == NULL || info->type == stream::STREAM_AUDIO) {
+        return 'A';
+    }
+    if (info->type == stream::STREAM_IMAGE) {
+        return 'I';
+    }
+
+    auto data = (uint8_t const*)frame.data();
+    int size = frame.size();
+    int pos = (size > 4 && data[2] == 0x01) ? 3 : 4;
+    if (size <= pos) {
+        return 'P';
+    }
+    return (data[pos] & 0x1f) == stream::NALU_TYPE_SLICE ? 'P' : 'I';
+}
+
+
+/// 多码流的切换线程, 停止码流要等收流线程同步, 不能在收流线程里做
+class CProfileSwitcher : public wize::CLoopThread
+{
+public:
+    static CProfileSwitcher* instance()
+    {
+        // never deleted, streams may be destroyed during static destruction
+        static CProfileSwitcher* switcher = new CProfileSwitcher();
+        return switcher;
+    }
+
+    void add(CRtspProfileStream* stream)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStreams.push_back(stream);
+    }
+
+    /// 返回后不会再调用 stream
+    void remove(CRtspProfileStream* stream)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStreams.erase(std::remove(mStreams.begin(), mStreams.end(), stream), mStreams.end());
+    }
+
+private:
+    CProfileSwitcher()
+        : wize::CLoopThread("RtspProfile")
+        , mLastTotal(0)
+        , mLastIdle(0)
+        , mCpuPercent(-1)
+        , mCpuSampleMs(0)
+    {
+        startThread();
+    }
+
+    void threadProc()
+    {
+        while (waitSignal(200) != SIGNAL_EXIT) {
+            uint64_t now = monotonicMs();
+            if (now - mCpuSampleMs >= 1000) {
+                mCpuSampleMs = now;
+                mCpuPercent = sampleCpu();
+            }
+
+            // holds the lock, so that remove() waits for a poll in progress
+            std::lock_guard<std::mutex> lock(mMutex);
+            for (auto stream : mStreams) {
+                stream->poll(now, mCpuPercent);
+            }
+        }
+    }
+
+    /// 整机 CPU 使用率, 和上一次采样之间的平均
+    int sampleCpu()
+    {
+        FILE* fp = fopen("/proc/stat", "r");
+        if (fp == NULL) {
+            return -1;
+        }
+
+        unsigned long long user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0, softirq = 0, steal = 0;
+        int n = fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+                       &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
+        fclose(fp);
+        if (n < 4) {
+            return -1;
+        }
+
+        uint64_t total = user + nice + system + idle + iowait + irq + softirq + steal;
+        uint64_t idleAll = idle + iowait;
+        int percent = -1;
+        if (mLastTotal != 0 && total > mLastTotal) {
+            percent = (int)(100 * ((total - mLastTotal) - (idleAll - mLastIdle)) / (total - mLastTotal));
+        }
+
+        mLastTotal = total;
+        mLastIdle = idleAll;
+        return percent;
+    }
+
+private:
+    std::mutex                          mMutex;
+    std::vector<CRtspProfileStream*>    mStreams;
+    uint64_t                            mLastTotal;
+    uint64_t                            mLastIdle;
+    int                                 mCpuPercent;
+    uint64_t                            mCpuSampleMs;
+};
+
+
+} // namespace
+
+
+CRtspProfileStream::CRtspProfileStream(std::vector<stream::IStreamSourcePtr> const& profiles, RtspStreamOptions const& options,
+                                       ProfilePolicy const& policy)
+    : mProfiles(profiles)
+    , mFramePts(profiles.size(), 0)
+    , mOptions(options)
+    , mPolicy(policy)
+    , mQueueDepth(0)
+    , mStarted(false)
+    , mRunning(profiles.size(), false)
+    , mLastSwitchMs(0)
+    , mActive(0)
+    , mPending(-1)
+    , mPendingSinceMs(0)
+{
+    for (size_t i = 0; i < mProfiles.size(); ++i) {
+        mRtspProfiles.push_back(dynamic_cast<IRtspStreamSource*>(mProfiles[i].get()));
+
+        // frames of a profile that isn't output, or that no subscriber wants, aren't even assembled
+        auto callback = boost::bind(&CRtspProfileStream::onFrame, this, (int)i, _1);
+        auto handle = dynamic_cast<CRtspStreamHandle*>(mProfiles[i].get());
+        if (handle != NULL) {
+            mConnections.push_back(handle->connect(callback, FrameFilter(),
+                                                   boost::bind(&CRtspProfileStream::onFrameWanted, this, (int)i, _1, _2)));
+        } else {
+            mConnections.push_back(mProfiles[i]->connect(callback));
+        }
+    }
+
+    CProfileSwitcher::instance()->add(this);
+}
+
+CRtspProfileStream::~CRtspProfileStream()
+{
+    CProfileSwitcher::instance()->remove(this);
+    stop();
+
+    for (auto& connection : mConnections) {
+        connection.disconnect();
+    }
+}
+
+CRtspProfileStream::Connection CRtspProfileStream::connect(StreamCallback callback)
+{
+    if (mOptions.autoRequestKeyFrame) {
+        requestKeyFrame();
+    }
+    return mFanout.connect(callback);
+}
+
+CRtspProfileStream::Connection CRtspProfileStream::connect(StreamCallback callback, FrameFilter const& filter)
+{
+    if (mOptions.autoRequestKeyFrame) {
+        requestKeyFrame();
+    }
+    return mFanout.connect(callback, filter);
+}
+
+bool CRtspProfileStream::start()
+{
+    std::lock_guard<std::mutex> lock(mControlMutex);
+    if (mStarted) {
+        return true;
+    }
+
+    int active;
+    {
+        std::lock_guard<std::mutex> stateLock(mStateMutex);
+        mPending = -1;
+        active = mActive;
+    }
+
+    mStarted = true;
+    mRunning[active] = true;
+    return mProfiles[active]->start();
+}
+
+bool CRtspProfileStream::stop()
+{
+    std::lock_guard<std::mutex> lock(mControlMutex);
+    if (!mStarted) {
+        return true;
+    }
+
+    mStarted = false;
+    for (size_t i = 0; i < mProfiles.size(); ++i) {
+        if (mRunning[i]) {
+            mRunning[i] = false;
+            mProfiles[i]->stop();
+        }
+    }
+
+    std::lock_guard<std::mutex> stateLock(mStateMutex);
+    mPending = -1;
+    return true;
+}
+
+RtspStreamStats CRtspProfileStream::getStats()
+{
+    auto profile = mRtspProfiles[currentProfile()];
+    return profile != NULL ? profile->getStats() : RtspStreamStats();
+}
+
+bool CRtspProfileStream::requestKeyFrame()
+{
+    auto profile = mRtspProfiles[currentProfile()];
+    return profile != NULL && profile->requestKeyFrame();
+}
+
+void CRtspProfileStream::setConsumerBusy(bool busy)
+{
+    for (auto profile : mRtspProfiles) {
+        if (profile != NULL) {
+            profile->setConsumerBusy(busy);
+        }
+    }
+}
+
+int CRtspProfileStream::profileCount()
+{
+    return (int)mProfiles.size();
+}
+
+int CRtspProfileStream::currentProfile()
+{
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    return mActive;
+}
+
+void CRtspProfileStream::setProfile(int index)
+{
+    std::lock_guard<std::mutex> lock(mControlMutex);
+    switchTo(index, monotonicMs());
+}
+
+void CRtspProfileStream::reportQueueDepth(int depth)
+{
+    mQueueDepth = depth;
+}
+
+void CRtspProfileStream::switchTo(int index, uint64_t nowMs)
+{
+    if (index < 0 || index >= (int)mProfiles.size()) {
+        return;
+    }
+
+    mLastSwitchMs = nowMs;
+    {
+        std::lock_guard<std::mutex> lock(mStateMutex);
+        if (index == mActive) {
+            // cancels a pending switch, poll() stops that profile
+            mPending = -1;
+            return;
+        }
+        if (!mStarted) {
+            mActive = index;
+            return;
+        }
+        mPending = index;
+        mPendingSinceMs = nowMs;
+    }
+
+    rtspInfof(NULL, "switching to profile %d\n", index);
+    if (!mRunning[index]) {
+        mRunning[index] = true;
+        mProfiles[index]->start();
+    }
+    if (mRtspProfiles[index] != NULL) {
+        mRtspProfiles[index]->requestKeyFrame();
+    }
+}
+
+void CRtspProfileStream::poll(uint64_t nowMs, int cpuPercent)
+{
+    std::lock_guard<std::mutex> lock(mControlMutex);
+    if (!mStarted) {
+        return;
+    }
+
+    int active, pending;
+    {
+        std::lock_guard<std::mutex> stateLock(mStateMutex);
+        if (mPending >= 0 && nowMs - mPendingSinceMs >= (uint64_t)PENDING_TIMEOUT_MS) {
+            rtspWarnf(NULL, "no key frame from profile %d, switch cancelled\n", mPending);
+            mPending = -1;
+        }
+        active = mActive;
+        pending = mPending;
+    }
+
+    // the profiles that were switched away from
+    for (int i = 0; i < (int)mProfiles.size(); ++i) {
+        if (mRunning[i] && i != active && i != pending) {
+            mRunning[i] = false;
+            mProfiles[i]->stop();
+        }
+    }
+
+    if (!mPolicy.enabled || pending >= 0 || nowMs - mLastSwitchMs < (uint64_t)mPolicy.holdMs) {
+        return;
+    }
+
+    int depth = mQueueDepth;
+    bool queueUsed = mPolicy.queueHigh > 0;
+    bool high = (cpuPercent >= 0 && cpuPercent >= mPolicy.cpuHighPercent) || (queueUsed && depth >= mPolicy.queueHigh);
+    bool low = cpuPercent >= 0 && cpuPercent <= mPolicy.cpuLowPercent && (!queueUsed || depth <= mPolicy.queueLow);
+
+    if (high && active + 1 < (int)mProfiles.size()) {
+        rtspInfof(NULL, "overloaded (cpu %d%%, queue %d), degrade to profile %d\n", cpuPercent, depth, active + 1);
+        switchTo(active + 1, nowMs);
+    } else if (low && active > 0) {
+        rtspInfof(NULL, "load is low (cpu %d%%, queue %d), upgrade to profile %d\n", cpuPercent, depth, active - 1);
+        switchTo(active - 1, nowMs);
+    }
+}
+
+bool CRtspProfileStream::onFrameWanted(int index, char frametype, uint64_t pts)
+{
+    mFramePts[index] = pts;
+
+    std::lock_guard<std::mutex> lock(mStateMutex);
+    if (index == mPending) {
+        // until the switch, only its key frame matters
+        return frametype == 'I';
+    }
+
+    // (the exact decision, with frame sampling, is taken in onFrame(), one profile at a time)
+    return index == mActive && mFanout.mayWant(frametype);
+}
+
+void CRtspProfileStream::onFrame(int index, stream::CFrame const& frame)
+{
+    char frametype = frameType(frame);
+
+    // held from the active check to the delivery: once the new profile's key frame is out, no frame of the old profile
+    // that was checked before the switch can follow it
+    std::lock_guard<std::mutex> deliverLock(mDeliverMutex);
+    {
+        std::lock_guard<std::mutex> lock(mStateMutex);
+        if (index == mPending && frametype == 'I') {
+            // the new profile starts with a key frame, subscribers see no gap
+            mActive = index;
+            mPending = -1;
+        }
+
+        if (index != mActive) {
+            return;
+        }
+    }
+
+    // the frame's own pts, set by onFrameWanted() just before (profiles not created by createRtspStream() have none)
+    if (mFanout.wanted(frametype, mFramePts[index] != 0 ? mFramePts[index] : monotonicMs())) {
+        mFanout.deliver(frame);
+    }
+}
+
+
+} // namespace live555client
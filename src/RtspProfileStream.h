@@ -0,0 +1,88 @@
+#ifndef __APP_RTSP_CLIENT_PROFILE_STREAM_H__
+#define __APP_RTSP_CLIENT_PROFILE_STREAM_H__
+
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "stream/StreamSource.h"
+#include "live555client/Live555Client.h"
+#include "FrameFanout.h"
+
+
+namespace live555client {
+
+
+/// 多码流的流, 每个码流是一个 createRtspStream() 创建的流
+/// 切换时新码流和旧码流同时收流, 新码流的第一个 I 帧开始输出, 旧码流由切换线程停止
+class CRtspProfileStream : public IRtspProfileStreamSource
+{
+public:
+    CRtspProfileStream(std::vector<stream::IStreamSourcePtr> const& profiles, RtspStreamOptions const& options,
+                       ProfilePolicy const& policy);
+
+    ~CRtspProfileStream();
+
+    Connection connect(StreamCallback callback);
+
+    Connection connect(StreamCallback callback, FrameFilter const& filter);
+
+    bool start();
+
+    bool stop();
+
+    RtspStreamStats getStats();
+
+    bool requestKeyFrame();
+
+    void setConsumerBusy(bool busy);
+
+    int profileCount();
+
+    int currentProfile();
+
+    void setProfile(int index);
+
+    void reportQueueDepth(int depth);
+
+    /// 由切换线程定时调用: 停止不再输出的码流, 执行自动策略; cpuPercent < 0 表示取不到
+    void poll(uint64_t nowMs, int cpuPercent);
+
+private:
+    CRtspProfileStream(CRtspProfileStream const&);
+    CRtspProfileStream& operator=(CRtspProfileStream const&);
+
+    /// 码流 index 的收流线程组帧之前调用
+    bool onFrameWanted(int index, char frametype, uint64_t pts);
+
+    void onFrame(int index, stream::CFrame const& frame);
+
+    /// 持有 mControlMutex 时调用
+    void switchTo(int index, uint64_t nowMs);
+
+private:
+    std::vector<stream::IStreamSourcePtr> mProfiles;
+    std::vector<IRtspStreamSource*> mRtspProfiles;
+    std::vector<Connection> mConnections;
+    std::vector<uint64_t> mFramePts;    ///< 各码流当前帧的 pts, 只在该码流的收流线程里读写
+    RtspStreamOptions   mOptions;
+    ProfilePolicy       mPolicy;
+    CFrameFanout        mFanout;
+    std::atomic<int>    mQueueDepth;
+
+    std::mutex          mControlMutex;  ///< 串行化开启停止和切换, 会等收流线程, 不能在回调里使用
+    bool                mStarted;
+    std::vector<bool>   mRunning;       ///< 各码流是否已经开启
+    uint64_t            mLastSwitchMs;
+
+    std::mutex          mDeliverMutex;  ///< 切换期间新旧码流的收流线程同时投递, 一次只投递一帧, 保证顺序
+    std::mutex          mStateMutex;    ///< 保护输出状态, 回调里使用
+    int                 mActive;        ///< 正在输出的码流
+    int                 mPending;       ///< 等待 I 帧切换过去的码流, -1 表示没有
+    uint64_t            mPendingSinceMs;
+};
+
+
+} // namespace live555client
+
+#endif // __APP_RTSP_CLIENT_PROFILE_STREAM_H__
@@ -20,23 +20,50 @@ along with this library; if not, write to the Free Software Foundation, Inc.,
 // client application.  For a full-featured RTSP client application - with much more functionality, and many options - see
 // "openRTSP": http://www.live555.com/openRTSP/
 
+#include <fcntl.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <list>
+#include <map>
 #include "liveMedia.hh"
 #include "BasicUsageEnvironment.hh"
+#include "GroupsockHelper.hh"
 #include "wize/Log.h"
+#include "MediaHelpers.h"
+#include "RtspLog.h"
 #include "RtspStream.h"
+#include "ThreadPlacement.h"
+#include "TimerWheel.h"
+#include "TlsTransport.h"
 
 
 // By default, we request that the server stream its data using RTP/UDP.
 // If, instead, you want to request that the server stream via RTP-over-TCP, change the following to True:
 #define REQUEST_STREAMING_OVER_TCP False
 
+// The granularity of each receive thread's timer wheel, which runs the liveness, keep-alive, retry and duration timers of
+// all channels on the thread's connection, using a single delayed task:
+#define TIMER_TICK_MS 500
+
+// In archive mode, the data arrives as fast as the server and the network allow, on the RTSP connection's TCP socket;
+// use a large socket buffer so that the TCP window doesn't throttle it:
+#define ARCHIVE_RECEIVE_BUFFER_SIZE 8*1024*1024
 
 
 typedef wize::function<void(stream::CFrame const&)> StreamCallback;
+typedef wize::function<bool(char frametype, uint64_t pts)> FrameWantedCallback;
+typedef wize::function<void()> ThrottleCallback; // blocks while the consumer can't take more frames
 
 
 // Forward function definitions:
 
+class ourRTSPClient;
+class StreamClientState;
+
 // RTSP 'response handlers':
 void continueAfterDESCRIBE(RTSPClient* rtspClient, int resultCode, char* resultString);
 void continueAfterSETUP(RTSPClient* rtspClient, int resultCode, char* resultString);
@@ -46,15 +73,48 @@ void continueAfterPLAY(RTSPClient* rtspClient, int resultCode, char* resultStrin
 void subsessionAfterPlaying(void* clientData); // called when a stream's subsession (e.g., audio or video substream) ends
 void subsessionByeHandler(void* clientData); // called when a RTCP "BYE" is received for a subsession
 void streamTimerHandler(void* clientData);
-void checkDisconnectHandler(void* clientData);
   // called at the end of a stream's expected duration (if the stream has not already signaled its end using a RTCP "BYE")
+void livenessTimerHandler(void* clientData); // called when a channel may not have received a frame for too long
+void keepAliveTimerHandler(void* clientData);
+void retryChannelHandler(void* clientData);
+void cachedDescribeHandler(void* clientData); // uses a cached SDP description, instead of sending "DESCRIBE"
+
+class LoopTimers;
+
+// Used to create the "RTSPClient" object of a connection (and, for a "rtsps://" URL, to make its TLS connection):
+ourRTSPClient* openConnection(UsageEnvironment& env, char const* progName, char const* rtspURL,
+                              live555client::RtspStreamOptions const& options, LoopTimers& timers,
+                              std::atomic<char>* eventLoopWatchVariable, ourRTSPClient** clientRef);
 
-// The main streaming routine (for each "rtsp://" URL):
-void openURL(UsageEnvironment& env, char const* progName, char const* rtspURL, StreamCallback);
+// The main streaming routine (for each "rtsp://" URL), run on an already opened connection:
+StreamClientState* openChannel(ourRTSPClient* rtspClient, char const* rtspURL, StreamCallback, FrameWantedCallback,
+                               live555client::RtspStreamOptions const& options, live555client::StreamCounters* counters,
+                               live555client::SessionCache* cache, ThrottleCallback throttle);
+
+// Used to send the "DESCRIBE" of a channel, once no other channel of the connection is being set up:
+void startChannel(StreamClientState* scs);
 
 // Used to iterate through each stream's 'subsessions', setting up each one:
 void setupNextSubsession(RTSPClient* rtspClient);
 
+// Used to let the next waiting channel of the connection start its setup:
+void finishChannelSetup(ourRTSPClient* rtspClient);
+
+// Used to tear down a channel's session, keeping the channel so that it can be started again:
+void resetChannel(StreamClientState* scs);
+
+// Used to restart a failed channel; shuts down the whole connection if it was the only channel, or on socket errors:
+void failChannel(StreamClientState* scs, Boolean socketError = False);
+
+// Used when an archive channel has played its whole range; the channel is kept, but not restarted:
+void finishArchive(StreamClientState* scs);
+
+// Used to remove a channel from its connection:
+void closeChannel(StreamClientState* scs);
+
+// Used to ask the server for a key frame, using RTCP feedback (PLI or FIR); rate limited per channel.  Returns True if sent:
+Boolean requestKeyFrame(StreamClientState* scs);
+
 // Used to shut down and close a stream (including its "RTSPClient" object):
 void shutdownStream(RTSPClient* rtspClient, int exitCode = 1);
 
@@ -73,82 +133,138 @@ void usage(UsageEnvironment& env, char const* progName) {
   env << "\t(where each <rtsp-url-i> is a \"rtsp://\" URL)\n";
 }
 
-#if 0
-char eventLoopWatchVariable = 0;
-
-int test_main(int argc, char** argv) {
-  // Begin by setting up our usage environment:
-  TaskScheduler* scheduler = BasicTaskScheduler::createNew();
-  UsageEnvironment* env = BasicUsageEnvironment::createNew(*scheduler);
-
-  // We need at least one "rtsp://" URL argument:
-  if (argc < 2) {
-    usage(*env, argv[0]);
-    return 1;
-  }
-
-  // There are argc-1 URLs: argv[1] through argv[argc-1].  Open and start streaming each one:
-  for (int i = 1; i <= argc-1; ++i) {
-    openURL(*env, argv[0], argv[i]);
-  }
-
-  // All subsequent activity takes place within the event loop:
-  env->taskScheduler().doEventLoop(&eventLoopWatchVariable);
-    // This function call does not return, unless, at some point in time, "eventLoopWatchVariable" gets set to something non-zero.
-
-  return 0;
-
-  // If you choose to continue the application past this point (i.e., if you comment out the "return 0;" statement above),
-  // and if you don't intend to do anything more with the "TaskScheduler" and "UsageEnvironment" objects,
-  // then you can also reclaim the (small) memory used by these objects by uncommenting the following code:
-  /*
-    env->reclaim(); env = NULL;
-    delete scheduler; scheduler = NULL;
-  */
-}
-#endif
-
-// Define a class to hold per-stream state that we maintain throughout each stream's lifetime:
+// Define a class to hold per-stream state that we maintain throughout each stream's lifetime.
+// One "RTSPClient" (i.e., one RTSP connection) may carry several streams - e.g., the channels of a NVR - so this
+// state is kept per 'channel', rather than per "RTSPClient":
 
 class StreamClientState {
 public:
-  StreamClientState();
+  StreamClientState(ourRTSPClient* client, char const* url);
   virtual ~StreamClientState();
 
 public:
+  ourRTSPClient* client;
+  std::string url; // the channel's URL; replaced by the base URL returned by "DESCRIBE"
   MediaSubsessionIterator* iter;
   MediaSession* session;
   MediaSubsession* subsession;
   Boolean streamUsingTcp;
-  TaskToken streamTimerTask;
+  Boolean closing; // "closeChannel()" was called while our setup requests were still in flight
+  live555client::CTimerWheel::Timer streamTimer;
   double duration;
   StreamCallback callback;
-  int disconnectCounter;
-  TaskToken checkDisconnectTask;
+  FrameWantedCallback wanted;
+  ThrottleCallback throttle;
+  live555client::RtspStreamOptions options;
+  live555client::StreamCounters* counters;
+  live555client::SessionCache* cache; // if not NULL, the SDP description is reused when the channel is started again
+  TaskToken cachedDescribeTask;
+  Boolean keyFrameOnFirstFrame; // ask for a key frame as soon as the sender is known, so that decoding starts early
+  uint64_t lastFrameMs; // "monotonicMs()" of the last frame; only touched by the sink
+  live555client::CTimerWheel::Timer livenessTimer;
+  live555client::CTimerWheel::Timer keepAliveTimer;
+  live555client::CTimerWheel::Timer retryTimer;
+  int retryDelayMs;
+  uint64_t lastKeyFrameRequestMs;
+  u_int8_t firSequence;
+  live555client::CRtspLogLimiter logLimiter;
+};
+
+// The timers of a receive thread, kept across reconnects.  The wheel isn't advanced at a fixed rate: a single delayed task
+// is scheduled for the earliest armed timer, so an idle thread doesn't wake up at all:
+
+class LoopTimers {
+public:
+  LoopTimers(TaskScheduler& scheduler);
+  virtual ~LoopTimers();
+
+  void arm(live555client::CTimerWheel::Timer& timer, unsigned delayMs, live555client::CTimerWheel::TimerFunc* func, void* clientData);
+  void cancel(live555client::CTimerWheel::Timer& timer) { wheel.cancel(timer); } // (a task that is then due early just finds nothing to run)
+
+private:
+  static void tickHandler(void* clientData);
+  void reschedule();
+
+private:
+  TaskScheduler& scheduler;
+  live555client::CTimerWheel wheel;
+  TaskToken tickTask;
+  uint64_t tickDueMs;
+};
+
+// The "UsageEnvironment" of a receive thread.  "BasicUsageEnvironment" writes everything (including the verbose RTSP and
+// SDP dump of "RTSPClient") synchronously to "stderr", from the event loop; we put it into the thread's log queue instead,
+// a line at a time, to be written by the background log thread:
+
+class LogUsageEnvironment: public BasicUsageEnvironment {
+public:
+  static LogUsageEnvironment* createNew(TaskScheduler& taskScheduler);
+
+  // redefined virtual functions:
+  virtual UsageEnvironment& operator<<(char const* str);
+  virtual UsageEnvironment& operator<<(int i);
+  virtual UsageEnvironment& operator<<(unsigned u);
+  virtual UsageEnvironment& operator<<(double d);
+  virtual UsageEnvironment& operator<<(void* p);
+
+protected:
+  LogUsageEnvironment(TaskScheduler& taskScheduler);
+    // called only by createNew();
+  virtual ~LogUsageEnvironment();
+
+private:
+  UsageEnvironment& append(char const* fmt, ...);
+  void flushLine();
+
+private:
+  std::string fLine; // the line being written, without its "\r\n"
 };
 
-// If you're streaming just a single stream (i.e., just from a single URL, once), then you can define and use just a single
-// "StreamClientState" structure, as a global variable in your application.  However, because - in this demo application - we're
-// showing how to play multiple streams, concurrently, we can't do that.  Instead, we have to have a separate "StreamClientState"
-// structure for each "RTSPClient".  To do this, we subclass "RTSPClient", and add a "StreamClientState" field to the subclass:
+// We subclass "RTSPClient", so that it can keep the list of channels that share its connection.  Because each RTSP request
+// is constructed from the client's 'base URL', the channels take turns: only one channel at a time goes through
+// "DESCRIBE"/"SETUP"/"PLAY", and each channel selects its own URL before any other request is sent on its behalf.
+// In RTP-over-TCP mode, the interleaved data of all channels then arrives on this same socket, and is demultiplexed by
+// channel id (live555 gives each "SETUP" on a connection its own pair of channel ids).
 
 class ourRTSPClient: public RTSPClient {
 public:
-  static ourRTSPClient* createNew(UsageEnvironment& env, char const* rtspURL,
-          volatile char* eventLoopWatchVariable,
+  static ourRTSPClient* createNew(UsageEnvironment& env, char const* rtspURL, LoopTimers& timers,
+          std::atomic<char>* eventLoopWatchVariable,
 				  int verbosityLevel = 0,
 				  char const* applicationName = NULL,
-				  portNumBits tunnelOverHTTPPortNum = 0);
+				  portNumBits tunnelOverHTTPPortNum = 0,
+				  int socketNumToServer = -1);
+
+  // Makes the following requests refer to this channel's URL:
+  void selectChannel(StreamClientState* scs);
 
 protected:
-  ourRTSPClient(UsageEnvironment& env, char const* rtspURL, volatile char* eventLoopWatchVariable,
-		int verbosityLevel, char const* applicationName, portNumBits tunnelOverHTTPPortNum);
+  // redefined virtual functions:
+  virtual Boolean setRequestFields(RequestRecord* request,
+				   char*& cmdURL, Boolean& cmdURLWasAllocated,
+				   char const*& protocolStr,
+				   char*& extraHeaders, Boolean& extraHeadersWereAllocated);
+    // adds the "Speed:" and "Rate-Control:" headers to the "PLAY" of an archive channel,
+    // and gives session-level requests the session id of their own channel
+  virtual unsigned sendRequest(RequestRecord* request);
+    // refuses to reopen a closed TLS connection in the clear
+
+
+  ourRTSPClient(UsageEnvironment& env, char const* rtspURL, LoopTimers& timers, std::atomic<char>* eventLoopWatchVariable,
+		int verbosityLevel, char const* applicationName, portNumBits tunnelOverHTTPPortNum, int socketNumToServer);
     // called only by createNew();
   virtual ~ourRTSPClient();
 
+  static void replaceSessionHeader(MediaSession& session, char*& extraHeaders, Boolean& extraHeadersWereAllocated);
+
 public:
-  StreamClientState scs;
-  volatile char* eventLoopWatchVariable;
+  std::list<StreamClientState*> channels; // all channels using this connection
+  std::list<StreamClientState*> pendingChannels; // channels waiting for their turn to be set up
+  StreamClientState* setupChannel; // the channel whose setup requests are currently in flight
+  std::atomic<char>* eventLoopWatchVariable;
+  ourRTSPClient** clientRef; // cleared when we're closed
+  LoopTimers& timers; // the timers of all channels
+  live555client::CTlsTransport* tls; // for a "rtsps://" connection; its socket is our (already connected) socket to the server
 };
 
 // Define a data sink (a subclass of "MediaSink") to receive the data for each subsession (i.e., each audio or video 'substream').
@@ -161,10 +277,10 @@ public:
   static DummySink* createNew(UsageEnvironment& env,
 			      MediaSubsession& subsession, // identifies the kind of data that's being received
                   char const* streamId, // identifies the stream itself (optional)
-                  StreamCallback);
+                  StreamCallback, FrameWantedCallback);
 
 private:
-  DummySink(UsageEnvironment& env, MediaSubsession& subsession, char const* streamId, StreamCallback);
+  DummySink(UsageEnvironment& env, MediaSubsession& subsession, char const* streamId, StreamCallback, FrameWantedCallback);
     // called only by "createNew()"
   virtual ~DummySink();
 
@@ -178,36 +294,204 @@ private:
 private:
   // redefined virtual functions:
   virtual Boolean continuePlaying();
+  virtual void stopPlaying();
+    // also drops the frame being assembled and the audio batch, so that nothing of this session is output later
+
+  // asks the subscribers whether this frame is wanted, before any "CFrame" gets allocated for it
+  bool frameWanted(char frametype, uint64_t pts);
+
+  // checks the RTP sequence numbers received so far; returns true if packets were lost since the previous frame
+  bool checkPacketLoss();
+
+  // returns false if the frame has to be dropped, because it (or a frame it depends on) misses packets
+  bool frameIntact(char frametype, bool lost);
+
+  // outputs an audio frame, or adds it to the current batch; an ADTS header is put in front of each AAC access unit
+  void deliverAudio(uint64_t pts, unsigned frameSize, int batchMs);
+
+  // makes "mFrame" from the current audio batch, if anybody wants it
+  void flushAudio();
 
 private:
   StreamCallback mCallback;
-  wize::CBuffer  mSPS;
-  wize::CBuffer  mPPS;
-  wize::CBuffer  mSEI;
+  FrameWantedCallback mWanted;
+  live555client::CH264ParameterSets mParameterSets; // kept across unwanted IDRs, for the next wanted one
   stream::CFrame mFrame;
   int            mSequence;
+  unsigned       mPacketsLost;
+  live555client::CLossGate mLossGate; // waits for the next IDR after a loss, with "dropCorruptFrames"
+  int            mAudioCodec; // "ENCODE_NONE" if the subsession's audio codec is not supported
+  unsigned       mAudioSampleRate;
+  unsigned       mAudioChannels;
+  live555client::AacConfig mAacConfig; // from the AudioSpecificConfig in the SDP's "config=" parameter
+  wize::CBuffer  mAudioBatch;
+  uint64_t       mAudioBatchPts;
   u_int8_t* fReceiveBuffer;
   MediaSubsession& fSubsession;
   char* fStreamId;
 };
 
-#define RTSP_CLIENT_VERBOSITY_LEVEL 1 // by default, print verbose output from each "RTSPClient"
+static uint64_t monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// The back-off after a failure: "firstMs" (the stream's "reconnectDelayMs"), doubled each time up to four times that,
+// then starting over.  "lastMs" is 0 before the first retry:
+static int nextRetryDelay(int lastMs, int firstMs) {
+  if (firstMs < 1) firstMs = 1;
+  return (lastMs < firstMs || lastMs >= 4*firstMs) ? firstMs : lastMs*2;
+}
+
+// Implementation of "LogUsageEnvironment":
+
+// Lines longer than a log entry are cut into several entries:
+#define LOG_LINE_MAX_SIZE 400
+
+LogUsageEnvironment* LogUsageEnvironment::createNew(TaskScheduler& taskScheduler) {
+  return new LogUsageEnvironment(taskScheduler);
+}
+
+LogUsageEnvironment::LogUsageEnvironment(TaskScheduler& taskScheduler)
+  : BasicUsageEnvironment(taskScheduler) {
+}
+
+LogUsageEnvironment::~LogUsageEnvironment() {
+  flushLine();
+}
+
+UsageEnvironment& LogUsageEnvironment::operator<<(char const* str) {
+  if (str == NULL) str = "(NULL)"; // as "BasicUsageEnvironment" does
+
+  while (*str != '\0') {
+    char const* end = strchr(str, '\n');
+    if (end == NULL) {
+      fLine += str;
+      break;
+    }
+    fLine.append(str, end - str);
+    flushLine();
+    str = end + 1;
+  }
+  if (fLine.size() >= LOG_LINE_MAX_SIZE) flushLine();
+
+  return *this;
+}
+
+UsageEnvironment& LogUsageEnvironment::operator<<(int i) {
+  return append("%d", i);
+}
+
+UsageEnvironment& LogUsageEnvironment::operator<<(unsigned u) {
+  return append("%u", u);
+}
+
+UsageEnvironment& LogUsageEnvironment::operator<<(double d) {
+  return append("%f", d);
+}
+
+UsageEnvironment& LogUsageEnvironment::operator<<(void* p) {
+  return append("%p", p);
+}
+
+UsageEnvironment& LogUsageEnvironment::append(char const* fmt, ...) {
+  char buf[64];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof buf, fmt, ap);
+  va_end(ap);
+  return *this << buf;
+}
+
+void LogUsageEnvironment::flushLine() {
+  if (!fLine.empty() && fLine[fLine.size()-1] == '\r') fLine.resize(fLine.size()-1);
+  if (fLine.empty()) return;
+
+  // Most of this is the verbose dump, which is enabled only at trace level (see "openConnection()"); the rest is the rare
+  // message of live555 itself:
+  rtspInfof(NULL, "%s\n", fLine.c_str());
+  fLine.clear();
+}
+
+// live555's verbose output goes through our "LogUsageEnvironment"; enable it when the runtime log level is trace.  (This
+// is read for each new connection, so changing the level takes effect at the next connect or reconnect.)
+static int verbosityLevel() {
+  return live555client::rtspLogLevel() <= RTSP_LOG_LEVEL_TRACE ? 1 : 0;
+}
 
-//static unsigned rtspClientCount = 0; // Counts how many streams (i.e., "RTSPClient"s) are currently in use.
+ourRTSPClient* openConnection(UsageEnvironment& env, char const* progName, char const* rtspURL,
+                              live555client::RtspStreamOptions const& options, LoopTimers& timers,
+                              std::atomic<char>* eventLoopWatchVariable, ourRTSPClient** clientRef) {
+  // "RTSPClient" knows only plain "rtsp://".  For "rtsps://", we make the TLS connection ourselves (blocking, with a
+  // timeout), and give "RTSPClient" the resulting plaintext socket, along with the equivalent "rtsp://" URL:
+  live555client::CTlsTransport* tls = NULL;
+  if (live555client::CTlsTransport::isSecureUrl(rtspURL)) {
+    tls = live555client::CTlsTransport::open(rtspURL, options);
+    if (tls == NULL) return NULL;
+  }
+  std::string url = tls != NULL ? live555client::CTlsTransport::plainUrl(rtspURL) : std::string(rtspURL);
 
-void openURL(UsageEnvironment& env, char const* progName, char const* rtspURL, StreamCallback callback, volatile char* eventLoopWatchVariable) {
-  // Begin by creating a "RTSPClient" object.  Note that there is a separate "RTSPClient" object for each stream that we wish
-  // to receive (even if more than stream uses the same "rtsp://" URL).
-  ourRTSPClient* rtspClient = ourRTSPClient::createNew(env, rtspURL, eventLoopWatchVariable, RTSP_CLIENT_VERBOSITY_LEVEL, progName);
+  // Begin by creating a "RTSPClient" object.  Its TCP connection is made when the first request is sent,
+  // and is then shared by all channels that we open on it:
+  ourRTSPClient* rtspClient = ourRTSPClient::createNew(env, url.c_str(), timers, eventLoopWatchVariable, verbosityLevel(), progName,
+                                                       0, tls != NULL ? tls->socketNum() : -1);
   if (rtspClient == NULL) {
-    env << "Failed to create a RTSP client for URL \"" << rtspURL << "\": " << env.getResultMsg() << "\n";
-    return;
+    rtspErrorf(NULL, "Failed to create a RTSP client for URL \"%s\": %s\n", url.c_str(), env.getResultMsg());
+    if (tls != NULL) {
+      ::close(tls->socketNum());
+      delete tls;
+    }
+    return NULL;
   }
 
+  rtspClient->tls = tls;
+  rtspClient->clientRef = clientRef;
+  return rtspClient;
+}
+
+StreamClientState* openChannel(ourRTSPClient* rtspClient, char const* rtspURL, StreamCallback callback, FrameWantedCallback wanted,
+                               live555client::RtspStreamOptions const& options, live555client::StreamCounters* counters,
+                               live555client::SessionCache* cache, ThrottleCallback throttle) {
+  // (The channel's URL has to match the form that the connection's "RTSPClient" was given.)
+  std::string url = live555client::CTlsTransport::isSecureUrl(rtspURL) ? live555client::CTlsTransport::plainUrl(rtspURL) : std::string(rtspURL);
+  StreamClientState* scs = new StreamClientState(rtspClient, url.c_str());
+
   // set stream callback
-  rtspClient->scs.callback = callback;
+  scs->callback = callback;
+  scs->wanted = wanted;
+  scs->throttle = throttle;
+  scs->options = options;
+  scs->counters = counters;
+  scs->cache = cache;
+  if (options.streamUsingTcp) scs->streamUsingTcp = True;
+
+  rtspClient->channels.push_back(scs);
+  startChannel(scs);
+  return scs;
+}
+
+void startChannel(StreamClientState* scs) {
+  ourRTSPClient* rtspClient = scs->client;
+  if (rtspClient->setupChannel != NULL) {
+    // Another channel is being set up; wait for our turn:
+    rtspClient->pendingChannels.push_back(scs);
+    return;
+  }
+
+  rtspClient->setupChannel = scs;
+  scs->keyFrameOnFirstFrame = scs->options.autoRequestKeyFrame || scs->options.onDemand;
+
+  if (scs->cache != NULL && !scs->cache->sdp.empty()) {
+    // Save the "DESCRIBE" round trip, using the SDP description (and base URL) that we got last time.  (It's dropped if the
+    // channel fails, so a stale one costs one retry.)  The response handler is called from the event loop, as usual:
+    scs->url = scs->cache->baseUrl;
+    rtspClient->selectChannel(scs);
+    scs->cachedDescribeTask = rtspClient->envir().taskScheduler().scheduleDelayedTask(0, (TaskFunc*)cachedDescribeHandler, scs);
+    return;
+  }
 
-  //++rtspClientCount;
+  rtspClient->selectChannel(scs);
 
   // Next, send a RTSP "DESCRIBE" command, to get a SDP description for the stream.
   // Note that this command - like all RTSP commands - is sent asynchronously; we do not block, waiting for a response.
@@ -215,36 +499,70 @@ void openURL(UsageEnvironment& env, char const* progName, char const* rtspURL, S
   rtspClient->sendDescribeCommand(continueAfterDESCRIBE);
 }
 
+void finishChannelSetup(ourRTSPClient* rtspClient) {
+  rtspClient->setupChannel = NULL;
+
+  if (!rtspClient->pendingChannels.empty()) {
+    StreamClientState* next = rtspClient->pendingChannels.front();
+    rtspClient->pendingChannels.pop_front();
+    startChannel(next);
+  }
+}
+
+// Returns the channel whose setup response this is, or NULL if that channel was closed in the meantime:
+static StreamClientState* setupChannelOf(RTSPClient* rtspClient, char* resultString) {
+  ourRTSPClient* client = (ourRTSPClient*)rtspClient;
+  StreamClientState* scs = client->setupChannel;
+  if (scs != NULL && !scs->closing) return scs;
+
+  delete[] resultString;
+  finishChannelSetup(client);
+  if (scs != NULL) closeChannel(scs);
+  return NULL;
+}
+
 
 // Implementation of the RTSP 'response handlers':
 
 void continueAfterDESCRIBE(RTSPClient* rtspClient, int resultCode, char* resultString) {
+  StreamClientState* pscs = setupChannelOf(rtspClient, resultString);
+  if (pscs == NULL) return;
+  StreamClientState& scs = *pscs; // alias
+
   do {
     UsageEnvironment& env = rtspClient->envir(); // alias
-    StreamClientState& scs = ((ourRTSPClient*)rtspClient)->scs; // alias
 
     if (resultCode != 0) {
-      env << *rtspClient << "Failed to get a SDP description: " << resultString << "\n";
+      rtspWarnf(&scs.logLimiter, "[URL:\"%s\"]: Failed to get a SDP description: %s\n", scs.url.c_str(), resultString);
       delete[] resultString;
       break;
     }
 
+    // The server may have given us a new base URL (e.g., in a "Content-Base:" header); remember it for this channel:
+    scs.url = rtspClient->url();
+
     char* const sdpDescription = resultString;
-    env << *rtspClient << "Got a SDP description:\n" << sdpDescription << "\n";
+    rtspTracef(&scs.logLimiter, "[URL:\"%s\"]: Got a SDP description:\n%s\n", scs.url.c_str(), sdpDescription);
+    if (scs.cache != NULL) {
+      scs.cache->sdp = sdpDescription;
+      scs.cache->baseUrl = scs.url;
+    }
 
     // Create a media session object from this SDP description:
     scs.session = MediaSession::createNew(env, sdpDescription);
     delete[] sdpDescription; // because we don't need it anymore
     if (scs.session == NULL) {
-      env << *rtspClient << "Failed to create a MediaSession object from the SDP description: " << env.getResultMsg() << "\n";
+      rtspWarnf(&scs.logLimiter, "[URL:\"%s\"]: Failed to create a MediaSession object from the SDP description: %s\n",
+                scs.url.c_str(), env.getResultMsg());
       break;
     } else if (!scs.session->hasSubsessions()) {
-      env << *rtspClient << "This session has no media subsessions (i.e., no \"m=\" lines)\n";
+      rtspWarnf(&scs.logLimiter, "[URL:\"%s\"]: This session has no media subsessions (i.e., no \"m=\" lines)\n", scs.url.c_str());
       break;
     }
 
-    unsigned uSecsToDelay = (unsigned)(1000000);
-    scs.checkDisconnectTask = env.taskScheduler().scheduleDelayedTask(uSecsToDelay, (TaskFunc*)checkDisconnectHandler, rtspClient);
+    // Restart the channel if no frames arrive for a while (including the rest of its setup):
+    scs.lastFrameMs = monotonicMs();
+    scs.client->timers.arm(scs.livenessTimer, scs.options.noFrameTimeoutMs, livenessTimerHandler, &scs);
 
     // Then, create and set up our data source objects for the session.  We do this by iterating over the session's 'subsessions',
     // calling "MediaSubsession::initiate()", and then sending a RTSP "SETUP" command, on each one.
@@ -255,26 +573,24 @@ void continueAfterDESCRIBE(RTSPClient* rtspClient, int resultCode, char* resultS
   } while (0);
 
   // An unrecoverable error occurred with this stream.
-  shutdownStream(rtspClient);
+  finishChannelSetup((ourRTSPClient*)rtspClient);
+  failChannel(&scs, resultCode < 0);
 }
 
 void setupNextSubsession(RTSPClient* rtspClient) {
   UsageEnvironment& env = rtspClient->envir(); // alias
-  StreamClientState& scs = ((ourRTSPClient*)rtspClient)->scs; // alias
-  
+  StreamClientState& scs = *((ourRTSPClient*)rtspClient)->setupChannel; // alias
+
   scs.subsession = scs.iter->next();
   if (scs.subsession != NULL) {
     if (!scs.subsession->initiate()) {
-      env << *rtspClient << "Failed to initiate the \"" << *scs.subsession << "\" subsession: " << env.getResultMsg() << "\n";
+      rtspWarnf(&scs.logLimiter, "[URL:\"%s\"]: Failed to initiate the \"%s/%s\" subsession: %s\n", scs.url.c_str(),
+                scs.subsession->mediumName(), scs.subsession->codecName(), env.getResultMsg());
       setupNextSubsession(rtspClient); // give up on this subsession; go to the next one
     } else {
-      env << *rtspClient << "Initiated the \"" << *scs.subsession << "\" subsession (";
-      if (scs.subsession->rtcpIsMuxed()) {
-	env << "client port " << scs.subsession->clientPortNum();
-      } else {
-	env << "client ports " << scs.subsession->clientPortNum() << "-" << scs.subsession->clientPortNum()+1;
-      }
-      env << ")\n";
+      rtspTracef(&scs.logLimiter, "[URL:\"%s\"]: Initiated the \"%s/%s\" subsession (client port %u, rtcp %s)\n", scs.url.c_str(),
+                 scs.subsession->mediumName(), scs.subsession->codecName(), (unsigned)scs.subsession->clientPortNum(),
+                 scs.subsession->rtcpIsMuxed() ? "muxed" : "port+1");
 
       // Continue setting up this subsession, by sending a RTSP "SETUP" command:
       rtspClient->sendSetupCommand(*scs.subsession, continueAfterSETUP, False, scs.streamUsingTcp);
@@ -282,8 +598,14 @@ void setupNextSubsession(RTSPClient* rtspClient) {
     return;
   }
 
-  // We've finished setting up all of the subsessions.  Now, send a RTSP "PLAY" command to start the streaming:
-  if (scs.session->absStartTime() != NULL) {
+  // We've finished setting up all of the subsessions.  Now, send a RTSP "PLAY" command to start the streaming.
+  // (The session-level "PLAY" uses the session id of the last "SETUP", which is ours, because setups are serialized.)
+  if (!scs.options.archiveStart.empty()) {
+    // Archive mode: play the requested range of the recording, as fast as we can take it:
+    increaseReceiveBufferTo(env, rtspClient->socketNum(), ARCHIVE_RECEIVE_BUFFER_SIZE);
+    rtspClient->sendPlayCommand(*scs.session, continueAfterPLAY, scs.options.archiveStart.c_str(),
+                                scs.options.archiveEnd.empty() ? NULL : scs.options.archiveEnd.c_str(), scs.options.archiveScale);
+  } else if (scs.session->absStartTime() != NULL) {
     // Special case: The stream is indexed by 'absolute' time, so send an appropriate "PLAY" command:
     rtspClient->sendPlayCommand(*scs.session, continueAfterPLAY, scs.session->absStartTime(), scs.session->absEndTime());
   } else {
@@ -293,13 +615,17 @@ void setupNextSubsession(RTSPClient* rtspClient) {
 }
 
 void continueAfterSETUP(RTSPClient* rtspClient, int resultCode, char* resultString) {
+  StreamClientState* pscs = setupChannelOf(rtspClient, resultString);
+  if (pscs == NULL) return;
+
   bool setupAgain = false;
   UsageEnvironment& env = rtspClient->envir(); // alias
-  StreamClientState& scs = ((ourRTSPClient*)rtspClient)->scs; // alias
+  StreamClientState& scs = *pscs; // alias
 
   do {
     if (resultCode != 0) {
-      env << *rtspClient << "Failed to set up the \"" << *scs.subsession << "\" subsession: " << resultString << "\n";
+      rtspWarnf(&scs.logLimiter, "[URL:\"%s\"]: Failed to set up the \"%s/%s\" subsession: %s\n", scs.url.c_str(),
+                scs.subsession->mediumName(), scs.subsession->codecName(), resultString);
       if (resultCode == 461 && !scs.streamUsingTcp) {
         // using tcp to setup again
         setupAgain = true;
@@ -308,28 +634,25 @@ void continueAfterSETUP(RTSPClient* rtspClient, int resultCode, char* resultStri
       break;
     }
 
-    env << *rtspClient << "Set up the \"" << *scs.subsession << "\" subsession (";
-    if (scs.subsession->rtcpIsMuxed()) {
-      env << "client port " << scs.subsession->clientPortNum();
-    } else {
-      env << "client ports " << scs.subsession->clientPortNum() << "-" << scs.subsession->clientPortNum()+1;
-    }
-    env << ")\n";
+    rtspTracef(&scs.logLimiter, "[URL:\"%s\"]: Set up the \"%s/%s\" subsession (client port %u, rtcp %s)\n", scs.url.c_str(),
+               scs.subsession->mediumName(), scs.subsession->codecName(), (unsigned)scs.subsession->clientPortNum(),
+               scs.subsession->rtcpIsMuxed() ? "muxed" : "port+1");
 
     // Having successfully setup the subsession, create a data sink for it, and call "startPlaying()" on it.
     // (This will prepare the data sink to receive data; the actual flow of data from the client won't start happening until later,
     // after we've sent a RTSP "PLAY" command.)
 
-    scs.subsession->sink = DummySink::createNew(env, *scs.subsession, rtspClient->url(), scs.callback);
+    scs.subsession->sink = DummySink::createNew(env, *scs.subsession, scs.url.c_str(), scs.callback, scs.wanted);
       // perhaps use your own custom "MediaSink" subclass instead
     if (scs.subsession->sink == NULL) {
-      env << *rtspClient << "Failed to create a data sink for the \"" << *scs.subsession
-	  << "\" subsession: " << env.getResultMsg() << "\n";
+      rtspWarnf(&scs.logLimiter, "[URL:\"%s\"]: Failed to create a data sink for the \"%s/%s\" subsession: %s\n", scs.url.c_str(),
+                scs.subsession->mediumName(), scs.subsession->codecName(), env.getResultMsg());
       break;
     }
 
-    env << *rtspClient << "Created a data sink for the \"" << *scs.subsession << "\" subsession\n";
-    scs.subsession->miscPtr = rtspClient; // a hack to let subsession handler functions get the "RTSPClient" from the subsession 
+    rtspTracef(&scs.logLimiter, "[URL:\"%s\"]: Created a data sink for the \"%s/%s\" subsession\n", scs.url.c_str(),
+               scs.subsession->mediumName(), scs.subsession->codecName());
+    scs.subsession->miscPtr = &scs; // a hack to let subsession handler functions get the channel from the subsession
     scs.subsession->sink->startPlaying(*(scs.subsession->readSource()),
 				       subsessionAfterPlaying, scs.subsession);
     // Also set a handler to be called if a RTCP "BYE" arrives for this subsession:
@@ -339,7 +662,11 @@ void continueAfterSETUP(RTSPClient* rtspClient, int resultCode, char* resultStri
   } while (0);
   delete[] resultString;
 
-  if (setupAgain) {
+  if (resultCode < 0) {
+    // The connection itself failed:
+    finishChannelSetup((ourRTSPClient*)rtspClient);
+    failChannel(&scs, True);
+  } else if (setupAgain) {
     // Continue setting up this subsession, by sending a RTSP "SETUP" command:
     rtspClient->sendSetupCommand(*scs.subsession, continueAfterSETUP, False, scs.streamUsingTcp);
   } else {
@@ -349,14 +676,14 @@ void continueAfterSETUP(RTSPClient* rtspClient, int resultCode, char* resultStri
 }
 
 void continueAfterPLAY(RTSPClient* rtspClient, int resultCode, char* resultString) {
+  StreamClientState* pscs = setupChannelOf(rtspClient, resultString);
+  if (pscs == NULL) return;
+  StreamClientState& scs = *pscs; // alias
   Boolean success = False;
 
   do {
-    UsageEnvironment& env = rtspClient->envir(); // alias
-    StreamClientState& scs = ((ourRTSPClient*)rtspClient)->scs; // alias
-
     if (resultCode != 0) {
-      env << *rtspClient << "Failed to start playing session: " << resultString << "\n";
+      rtspWarnf(&scs.logLimiter, "[URL:\"%s\"]: Failed to start playing session: %s\n", scs.url.c_str(), resultString);
       break;
     }
 
@@ -367,23 +694,27 @@ void continueAfterPLAY(RTSPClient* rtspClient, int resultCode, char* resultStrin
     if (scs.duration > 0) {
       unsigned const delaySlop = 2; // number of seconds extra to delay, after the stream's expected duration.  (This is optional.)
       scs.duration += delaySlop;
-      unsigned uSecsToDelay = (unsigned)(scs.duration*1000000);
-      scs.streamTimerTask = env.taskScheduler().scheduleDelayedTask(uSecsToDelay, (TaskFunc*)streamTimerHandler, rtspClient);
+      scs.client->timers.arm(scs.streamTimer, (unsigned)(scs.duration*1000), streamTimerHandler, &scs);
+    }
+
+    if (scs.options.keepAliveIntervalMs > 0) {
+      scs.client->timers.arm(scs.keepAliveTimer, scs.options.keepAliveIntervalMs, keepAliveTimerHandler, &scs);
     }
 
-    env << *rtspClient << "Started playing session";
     if (scs.duration > 0) {
-      env << " (for up to " << scs.duration << " seconds)";
+      rtspInfof(&scs.logLimiter, "[URL:\"%s\"]: Started playing session (for up to %.1f seconds)...\n", scs.url.c_str(), scs.duration);
+    } else {
+      rtspInfof(&scs.logLimiter, "[URL:\"%s\"]: Started playing session...\n", scs.url.c_str());
     }
-    env << "...\n";
 
     success = True;
   } while (0);
   delete[] resultString;
 
+  finishChannelSetup((ourRTSPClient*)rtspClient);
   if (!success) {
     // An unrecoverable error occurred with this stream.
-    shutdownStream(rtspClient);
+    failChannel(&scs, resultCode < 0);
   }
 }
 
@@ -392,7 +723,7 @@ void continueAfterPLAY(RTSPClient* rtspClient, int resultCode, char* resultStrin
 
 void subsessionAfterPlaying(void* clientData) {
   MediaSubsession* subsession = (MediaSubsession*)clientData;
-  RTSPClient* rtspClient = (RTSPClient*)(subsession->miscPtr);
+  StreamClientState* scs = (StreamClientState*)(subsession->miscPtr);
 
   // Begin by closing this subsession's stream:
   Medium::close(subsession->sink);
@@ -405,60 +736,90 @@ void subsessionAfterPlaying(void* clientData) {
     if (subsession->sink != NULL) return; // this subsession is still active
   }
 
-  // All subsessions' streams have now been closed, so shutdown the client:
-  shutdownStream(rtspClient);
+  // All subsessions' streams have now been closed, so restart the channel (unless it was an archive that has ended):
+  if (!scs->options.archiveStart.empty()) {
+    finishArchive(scs);
+  } else {
+    failChannel(scs);
+  }
 }
 
 void subsessionByeHandler(void* clientData) {
   MediaSubsession* subsession = (MediaSubsession*)clientData;
-  RTSPClient* rtspClient = (RTSPClient*)subsession->miscPtr;
-  UsageEnvironment& env = rtspClient->envir(); // alias
+  StreamClientState* scs = (StreamClientState*)subsession->miscPtr;
 
-  env << *rtspClient << "Received RTCP \"BYE\" on \"" << *subsession << "\" subsession\n";
+  rtspInfof(&scs->logLimiter, "[URL:\"%s\"]: Received RTCP \"BYE\" on \"%s/%s\" subsession\n", scs->url.c_str(),
+            subsession->mediumName(), subsession->codecName());
 
   // Now act as if the subsession had closed:
   subsessionAfterPlaying(subsession);
 }
 
 void streamTimerHandler(void* clientData) {
-  ourRTSPClient* rtspClient = (ourRTSPClient*)clientData;
-  StreamClientState& scs = rtspClient->scs; // alias
-
-  scs.streamTimerTask = NULL;
+  StreamClientState* scs = (StreamClientState*)clientData;
 
   // Shut down the stream:
-  shutdownStream(rtspClient);
+  failChannel(scs);
 }
 
-void checkDisconnectHandler(void* clientData) {
-  ourRTSPClient* rtspClient = (ourRTSPClient*)clientData;
-  UsageEnvironment& env = rtspClient->envir(); // alias
-  StreamClientState& scs = rtspClient->scs; // alias
+void livenessTimerHandler(void* clientData) {
+  StreamClientState* scs = (StreamClientState*)clientData;
+  uint64_t timeoutMs = (uint64_t)scs->options.noFrameTimeoutMs;
+  uint64_t now = monotonicMs();
+  uint64_t idleMs = now > scs->lastFrameMs ? now - scs->lastFrameMs : 0;
 
-  //env << *rtspClient << "check disconnect handler, counter:" << scs.disconnectCounter << "\n";
-  if (++scs.disconnectCounter < 5) {
-    // next round
-    unsigned uSecsToDelay = (unsigned)(1000000);
-    scs.checkDisconnectTask = env.taskScheduler().scheduleDelayedTask(uSecsToDelay, (TaskFunc*)checkDisconnectHandler, rtspClient);
+  if (idleMs < timeoutMs) {
+    // Frames arrived in the meantime; check again when the last one is "timeoutMs" old:
+    scs->client->timers.arm(scs->livenessTimer, (unsigned)(timeoutMs - idleMs), livenessTimerHandler, scs);
     return;
   }
 
-  env << *rtspClient << "shutdown stream, counter:" << scs.disconnectCounter << "\n";
-  shutdownStream(rtspClient);
+  rtspWarnf(&scs->logLimiter, "[URL:\"%s\"]: no frame for %llu ms, restarting the channel\n", scs->url.c_str(),
+            (unsigned long long)idleMs);
+  failChannel(scs);
 }
 
-void shutdownStream(RTSPClient* rtspClient, int exitCode) {
-  UsageEnvironment& env = rtspClient->envir(); // alias
-  StreamClientState& scs = ((ourRTSPClient*)rtspClient)->scs; // alias
+void keepAliveTimerHandler(void* clientData) {
+  StreamClientState* scs = (StreamClientState*)clientData;
+  ourRTSPClient* rtspClient = scs->client;
+
+  // Don't disturb another channel's setup (which owns the client's base URL); just try again next time:
+  if (scs->session != NULL && rtspClient->setupChannel == NULL) {
+    rtspClient->selectChannel(scs);
+    rtspClient->sendGetParameterCommand(*scs->session, NULL, NULL);
+  }
+
+  rtspClient->timers.arm(scs->keepAliveTimer, scs->options.keepAliveIntervalMs, keepAliveTimerHandler, scs);
+}
+
+void retryChannelHandler(void* clientData) {
+  StreamClientState* scs = (StreamClientState*)clientData;
+
+  startChannel(scs);
+}
+
+void cachedDescribeHandler(void* clientData) {
+  StreamClientState* scs = (StreamClientState*)clientData;
+
+  scs->cachedDescribeTask = NULL;
+  rtspTracef(&scs->logLimiter, "[URL:\"%s\"]: Using the cached SDP description\n", scs->url.c_str());
+  continueAfterDESCRIBE(scs->client, 0, strDup(scs->cache->sdp.c_str()));
+}
+
+void resetChannel(StreamClientState* scs) {
+  ourRTSPClient* rtspClient = scs->client;
 
   // First, check whether any subsessions have still to be closed:
-  if (scs.session != NULL) { 
+  if (scs->session != NULL) {
     Boolean someSubsessionsWereActive = False;
-    MediaSubsessionIterator iter(*scs.session);
+    Boolean sharedConnection = rtspClient->channels.size() > 1;
+    MediaSubsessionIterator iter(*scs->session);
     MediaSubsession* subsession;
 
+    rtspClient->selectChannel(scs);
     while ((subsession = iter.next()) != NULL) {
       if (subsession->sink != NULL) {
+	subsession->sink->stopPlaying(); // (drops a partly assembled frame or audio batch, see "DummySink::stopPlaying()")
 	Medium::close(subsession->sink);
 	subsession->sink = NULL;
 
@@ -466,20 +827,191 @@ void shutdownStream(RTSPClient* rtspClient, int exitCode) {
 	  subsession->rtcpInstance()->setByeHandler(NULL, NULL); // in case the server sends a RTCP "BYE" while handling "TEARDOWN"
 	}
 
+	if (sharedConnection && subsession->sessionId() != NULL) {
+	  // The session-level "TEARDOWN" would use the session id of the last "SETUP" on this connection, which may be another channel's:
+	  rtspClient->sendTeardownCommand(*subsession, NULL);
+	}
+
 	someSubsessionsWereActive = True;
       }
     }
 
-    if (someSubsessionsWereActive) {
+    if (someSubsessionsWereActive && !sharedConnection) {
       // Send a RTSP "TEARDOWN" command, to tell the server to shutdown the stream.
       // Don't bother handling the response to the "TEARDOWN".
-      rtspClient->sendTeardownCommand(*scs.session, NULL);
+      rtspClient->sendTeardownCommand(*scs->session, NULL);
+    }
+
+    if (rtspClient->setupChannel != NULL) {
+      rtspClient->selectChannel(rtspClient->setupChannel);
+    }
+  }
+
+  rtspClient->timers.cancel(scs->streamTimer);
+  rtspClient->timers.cancel(scs->livenessTimer);
+  rtspClient->timers.cancel(scs->keepAliveTimer);
+  rtspClient->timers.cancel(scs->retryTimer);
+  rtspClient->envir().taskScheduler().unscheduleDelayedTask(scs->cachedDescribeTask);
+  delete scs->iter; scs->iter = NULL;
+  Medium::close(scs->session); scs->session = NULL;
+  scs->subsession = NULL;
+  scs->duration = 0.0;
+}
+
+void failChannel(StreamClientState* scs, Boolean socketError) {
+  ourRTSPClient* rtspClient = scs->client;
+
+  // The cached SDP description may be the reason; get a fresh one next time:
+  if (scs->cache != NULL) scs->cache->sdp.clear();
+
+  if (socketError || rtspClient->channels.size() == 1 || rtspClient->setupChannel == scs) {
+    // Reconnect from scratch, after the connection's back-off delay.  (This is also the only way to give up on a channel
+    // whose setup requests are still in flight, because their responses refer to its session.)
+    shutdownStream(rtspClient);
+    return;
+  }
+
+  // The other channels of the connection are fine; retry just this one:
+  resetChannel(scs);
+
+  scs->retryDelayMs = nextRetryDelay(scs->retryDelayMs, scs->options.reconnectDelayMs);
+  rtspInfof(&scs->logLimiter, "[URL:\"%s\"]: wait (%d)ms to retry open channel...\n", scs->url.c_str(), scs->retryDelayMs);
+  rtspClient->timers.arm(scs->retryTimer, scs->retryDelayMs, retryChannelHandler, scs);
+}
+
+void finishArchive(StreamClientState* scs) {
+  rtspInfof(&scs->logLimiter, "[URL:\"%s\"]: Finished playing the archive (%llu bytes).\n", scs->url.c_str(),
+            (unsigned long long)scs->counters->bytesReceived);
+  resetChannel(scs);
+  scs->counters->archiveFinished = true;
+
+  // An archive has a connection of its own (see "normalizeOptions()").  Once it's done, close the connection too, rather
+  // than keeping it open (and idle) until the stream is stopped:
+  ourRTSPClient* rtspClient = scs->client;
+  for (auto channel : rtspClient->channels) {
+    if (!channel->counters->archiveFinished) return;
+  }
+  *rtspClient->eventLoopWatchVariable = 1;
+}
+
+void closeChannel(StreamClientState* scs) {
+  ourRTSPClient* rtspClient = scs->client;
+
+  if (rtspClient->setupChannel == scs) {
+    // Our setup requests are still in flight, and their responses still refer to our session; so just stop delivering
+    // frames for now, and finish closing when the response arrives:
+    scs->closing = True;
+    if (scs->session != NULL) {
+      MediaSubsessionIterator iter(*scs->session);
+      MediaSubsession* subsession;
+      while ((subsession = iter.next()) != NULL) {
+	if (subsession->sink != NULL) subsession->sink->stopPlaying();
+	if (subsession->rtcpInstance() != NULL) subsession->rtcpInstance()->setByeHandler(NULL, NULL);
+      }
+    }
+    rtspClient->timers.cancel(scs->streamTimer);
+    rtspClient->timers.cancel(scs->livenessTimer);
+    rtspClient->timers.cancel(scs->keepAliveTimer);
+    return;
+  }
+
+  resetChannel(scs);
+  rtspClient->pendingChannels.remove(scs);
+  rtspClient->channels.remove(scs);
+  rtspInfof(&scs->logLimiter, "[URL:\"%s\"]: Closing the channel.\n", scs->url.c_str());
+  delete scs;
+}
+
+// Sends an interleaved packet on the RTSP connection.  Like "RTPInterface::sendDataOverTCP()", a packet that went out
+// only in part is finished with a (briefly) blocking write, because whatever is sent next on the connection would
+// otherwise land in the middle of it.  If that fails too, the connection is reopened.  Returns True if it was sent:
+static Boolean sendInterleaved(ourRTSPClient* rtspClient, u_int8_t const* packet, unsigned size) {
+  int sock = rtspClient->socketNum();
+  if (sock < 0) return False;
+
+  ssize_t sent = send(sock, packet, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (sent == (ssize_t)size) return True;
+  if (sent <= 0) return False; // nothing went out, so the stream of data on the connection is still intact
+
+  unsigned left = size - (unsigned)sent;
+  makeSocketBlocking(sock, 500);
+  while (left > 0) {
+    sent = send(sock, packet + size - left, left, MSG_NOSIGNAL);
+    if (sent <= 0) break;
+    left -= (unsigned)sent;
+  }
+  makeSocketNonBlocking(sock);
+
+  if (left > 0) {
+    rtspWarnf(NULL, "[URL:\"%s\"]: couldn't finish an interleaved RTCP packet, reopening the connection\n", rtspClient->url());
+    *rtspClient->eventLoopWatchVariable = 1;
+    return False;
+  }
+  return True;
+}
+
+Boolean requestKeyFrame(StreamClientState* scs) {
+  if (scs->session == NULL || scs->closing) return False;
+
+  uint64_t now = monotonicMs();
+  if (scs->lastKeyFrameRequestMs != 0 && now - scs->lastKeyFrameRequestMs < (uint64_t)scs->options.keyFrameRequestIntervalMs) {
+    return False;
+  }
+
+  Boolean anySent = False;
+  MediaSubsessionIterator iter(*scs->session);
+  MediaSubsession* subsession;
+  while ((subsession = iter.next()) != NULL) {
+    RTPSource* rtpSource = subsession->rtpSource();
+    if (strcmp(subsession->mediumName(), "video") != 0 || subsession->sink == NULL || rtpSource == NULL) continue;
+    if (rtpSource->lastReceivedSSRC() == 0) continue; // we don't know the sender yet
+
+    // an empty "RR" followed by a "PLI" or a "FIR", with room for the interleaving header in front:
+    u_int8_t packet[4 + live555client::KEY_FRAME_REQUEST_MAX_SIZE];
+    unsigned size = live555client::buildKeyFrameRequest(packet + 4, rtpSource->SSRC(), rtpSource->lastReceivedSSRC(),
+                                                        scs->options.keyFrameRequestFir, scs->firSequence++);
+
+    Boolean sent = False;
+    if (scs->streamUsingTcp) {
+      // RTP-over-TCP: send it interleaved on the RTSP connection, on the subsession's RTCP channel:
+      packet[0] = '$';
+      packet[1] = subsession->rtcpChannelId;
+      packet[2] = (u_int8_t)(size >> 8);
+      packet[3] = (u_int8_t)size;
+      sent = sendInterleaved(scs->client, packet, 4 + size);
+    } else if (subsession->rtcpInstance() != NULL && subsession->rtcpInstance()->RTCPgs() != NULL) {
+      // The RTCP groupsock's destination is the server's RTCP port (or its RTP port, if RTCP is muxed):
+      sent = subsession->rtcpInstance()->RTCPgs()->output(scs->client->envir(), packet + 4, size);
+    }
+
+    if (sent) {
+      ++scs->counters->keyFrameRequests;
+      scs->lastKeyFrameRequestMs = now;
+      anySent = True;
+      rtspTracef(&scs->logLimiter, "[URL:\"%s\"]: sent RTCP %s\n", scs->url.c_str(), scs->options.keyFrameRequestFir ? "FIR" : "PLI");
     }
   }
 
-  env << *rtspClient << "Closing the stream.\n";
+  return anySent;
+}
+
+void shutdownStream(RTSPClient* rtspClient, int exitCode) {
+  ourRTSPClient* client = (ourRTSPClient*)rtspClient;
+
+  // First, close all channels that are still open, sending "TEARDOWN" for their sessions:
+  client->setupChannel = NULL;
+  client->pendingChannels.clear();
+  while (!client->channels.empty()) {
+    StreamClientState* scs = client->channels.back();
+    resetChannel(scs);
+    client->channels.pop_back();
+    delete scs;
+  }
+
+  rtspInfof(NULL, "[URL:\"%s\"]: Closing the stream.\n", rtspClient->url());
+  auto eventLoopWatchVariable = client->eventLoopWatchVariable;
   Medium::close(rtspClient);
-    // Note that this will also cause this stream's "StreamClientState" structure to get reclaimed.
+    // Note that this will also clear the connection's reference to us.
 
 #if 0
   if (--rtspClientCount == 0) {
@@ -489,43 +1021,156 @@ void shutdownStream(RTSPClient* rtspClient, int exitCode) {
     exit(exitCode);
   }
 #endif
-  auto eventLoopWatchVariable = ((ourRTSPClient*)rtspClient)->eventLoopWatchVariable;
   *eventLoopWatchVariable = 1;
 }
 
 
+// Implementation of "LoopTimers":
+
+LoopTimers::LoopTimers(TaskScheduler& scheduler)
+  : scheduler(scheduler), wheel(TIMER_TICK_MS, monotonicMs()), tickTask(NULL), tickDueMs(0) {
+}
+
+LoopTimers::~LoopTimers() {
+  scheduler.unscheduleDelayedTask(tickTask);
+}
+
+void LoopTimers::arm(live555client::CTimerWheel::Timer& timer, unsigned delayMs, live555client::CTimerWheel::TimerFunc* func, void* clientData) {
+  wheel.armAt(timer, monotonicMs() + delayMs, func, clientData);
+  reschedule();
+}
+
+void LoopTimers::tickHandler(void* clientData) {
+  LoopTimers* timers = (LoopTimers*)clientData;
+
+  timers->tickTask = NULL;
+  timers->wheel.advance(monotonicMs());
+  timers->reschedule();
+}
+
+void LoopTimers::reschedule() {
+  uint64_t expiresMs;
+  if (!wheel.nextExpiry(expiresMs)) return; // (a pending task stays; it'll find nothing to do)
+  if (tickTask != NULL && tickDueMs <= expiresMs) return;
+
+  scheduler.unscheduleDelayedTask(tickTask);
+  uint64_t now = monotonicMs();
+  tickDueMs = expiresMs;
+  tickTask = scheduler.scheduleDelayedTask(expiresMs > now ? (int64_t)(expiresMs - now)*1000 : 0, (TaskFunc*)tickHandler, this);
+}
+
+
 // Implementation of "ourRTSPClient":
 
-ourRTSPClient* ourRTSPClient::createNew(UsageEnvironment& env, char const* rtspURL, volatile char* eventLoopWatchVariable,
-					int verbosityLevel, char const* applicationName, portNumBits tunnelOverHTTPPortNum) {
-  return new ourRTSPClient(env, rtspURL, eventLoopWatchVariable, verbosityLevel, applicationName, tunnelOverHTTPPortNum);
+ourRTSPClient* ourRTSPClient::createNew(UsageEnvironment& env, char const* rtspURL, LoopTimers& timers, std::atomic<char>* eventLoopWatchVariable,
+					int verbosityLevel, char const* applicationName, portNumBits tunnelOverHTTPPortNum,
+					int socketNumToServer) {
+  return new ourRTSPClient(env, rtspURL, timers, eventLoopWatchVariable, verbosityLevel, applicationName, tunnelOverHTTPPortNum, socketNumToServer);
 }
 
-ourRTSPClient::ourRTSPClient(UsageEnvironment& env, char const* rtspURL, volatile char* eventLoopWatchVariable,
-			     int verbosityLevel, char const* applicationName, portNumBits tunnelOverHTTPPortNum)
-  : RTSPClient(env,rtspURL, verbosityLevel, applicationName, tunnelOverHTTPPortNum, -1)
-  , eventLoopWatchVariable(eventLoopWatchVariable) {
+ourRTSPClient::ourRTSPClient(UsageEnvironment& env, char const* rtspURL, LoopTimers& timers, std::atomic<char>* eventLoopWatchVariable,
+			     int verbosityLevel, char const* applicationName, portNumBits tunnelOverHTTPPortNum, int socketNumToServer)
+  : RTSPClient(env,rtspURL, verbosityLevel, applicationName, tunnelOverHTTPPortNum, socketNumToServer)
+  , setupChannel(NULL), eventLoopWatchVariable(eventLoopWatchVariable), clientRef(NULL)
+  , timers(timers), tls(NULL) {
 }
 
 ourRTSPClient::~ourRTSPClient() {
+  if (clientRef != NULL) *clientRef = NULL;
+  if (tls != NULL && socketNum() >= 0) tls->finish(); // sends what we've written (e.g., "TEARDOWN"), then "close_notify"
+  delete tls; // stops its relay; our socket is closed by "~RTSPClient()"
+}
+
+unsigned ourRTSPClient::sendRequest(RequestRecord* request) {
+  if (tls != NULL && socketNum() < 0) {
+    // The TLS connection has been closed (after an error); "RTSPClient" would open a new one in the clear.  Drop the
+    // request, and leave the event loop instead, so that the whole connection gets reopened:
+    delete request;
+    *eventLoopWatchVariable = 1;
+    return 0;
+  }
+
+  return RTSPClient::sendRequest(request);
+}
+
+void ourRTSPClient::selectChannel(StreamClientState* scs) {
+  if (scs->url != url()) setBaseURL(scs->url.c_str());
+}
+
+Boolean ourRTSPClient::setRequestFields(RequestRecord* request,
+					char*& cmdURL, Boolean& cmdURLWasAllocated,
+					char const*& protocolStr,
+					char*& extraHeaders, Boolean& extraHeadersWereAllocated) {
+  if (!RTSPClient::setRequestFields(request, cmdURL, cmdURLWasAllocated, protocolStr, extraHeaders, extraHeadersWereAllocated)) {
+    return False;
+  }
+
+  if (request->session() != NULL) replaceSessionHeader(*request->session(), extraHeaders, extraHeadersWereAllocated);
+
+  // ("PLAY" requests are only sent during a channel's setup, so they belong to "setupChannel".)
+  StreamClientState* scs = setupChannel;
+  if (scs == NULL || scs->options.archiveStart.empty() || strcmp(request->commandName(), "PLAY") != 0) return True;
+
+  // "Speed:" (RFC 2326, 12.35) asks for faster delivery of the same media; "Rate-Control: no" (ONVIF streaming spec)
+  // asks a NVR to send its recording without pacing:
+  char speedHeader[64] = "";
+  if (scs->options.archiveSpeed > 0) snprintf(speedHeader, sizeof speedHeader, "Speed: %.3f\r\n", scs->options.archiveSpeed);
+  char const* rateControlHeader = "Rate-Control: no\r\n";
+
+  char const* oldHeaders = extraHeaders != NULL ? extraHeaders : "";
+  unsigned headersSize = strlen(oldHeaders) + strlen(speedHeader) + strlen(rateControlHeader) + 1;
+  char* headers = new char[headersSize];
+  snprintf(headers, headersSize, "%s%s%s", oldHeaders, speedHeader, rateControlHeader);
+
+  if (extraHeadersWereAllocated) delete[] extraHeaders;
+  extraHeaders = headers;
+  extraHeadersWereAllocated = True;
+  return True;
+}
+
+void ourRTSPClient::replaceSessionHeader(MediaSession& session, char*& extraHeaders, Boolean& extraHeadersWereAllocated) {
+  // "RTSPClient" uses the session id of the most recent "SETUP" for all session-level requests.  With several
+  // channels on this connection, that is some other channel's session, so use this session's own id instead:
+  char const* sessionId = NULL;
+  MediaSubsessionIterator iter(session);
+  MediaSubsession* subsession;
+  while ((subsession = iter.next()) != NULL) {
+    if (subsession->sessionId() != NULL) { sessionId = subsession->sessionId(); break; }
+  }
+  if (sessionId == NULL || extraHeaders == NULL) return;
+
+  char* header = strstr(extraHeaders, "Session: ");
+  if (header == NULL || (header != extraHeaders && header[-1] != '\n')) return;
+  char const* rest = strstr(header, "\r\n");
+  rest = rest != NULL ? rest + 2 : header + strlen(header);
+
+  unsigned headersSize = strlen(extraHeaders) + strlen(sessionId) + 16;
+  char* headers = new char[headersSize];
+  snprintf(headers, headersSize, "%.*sSession: %s\r\n%s", (int)(header - extraHeaders), extraHeaders, sessionId, rest);
+
+  if (extraHeadersWereAllocated) delete[] extraHeaders;
+  extraHeaders = headers;
+  extraHeadersWereAllocated = True;
 }
 
 
 // Implementation of "StreamClientState":
 
-StreamClientState::StreamClientState()
-  : iter(NULL), session(NULL), subsession(NULL), streamUsingTcp(REQUEST_STREAMING_OVER_TCP)
-  , streamTimerTask(NULL), duration(0.0), disconnectCounter(0), checkDisconnectTask(NULL) {
+StreamClientState::StreamClientState(ourRTSPClient* client, char const* url)
+  : client(client), url(url), iter(NULL), session(NULL), subsession(NULL), streamUsingTcp(REQUEST_STREAMING_OVER_TCP), closing(False)
+  , duration(0.0), counters(NULL), cache(NULL), cachedDescribeTask(NULL), keyFrameOnFirstFrame(False), lastFrameMs(0), retryDelayMs(0)
+  , lastKeyFrameRequestMs(0), firSequence(0) {
 }
 
 StreamClientState::~StreamClientState() {
+  client->timers.cancel(streamTimer);
+  client->timers.cancel(livenessTimer);
+  client->timers.cancel(keepAliveTimer);
+  client->timers.cancel(retryTimer);
+
   delete iter;
   if (session != NULL) {
-    // We also need to delete "session", and unschedule "streamTimerTask" (if set)
-    UsageEnvironment& env = session->envir(); // alias
-
-    env.taskScheduler().unscheduleDelayedTask(streamTimerTask);
-    env.taskScheduler().unscheduleDelayedTask(checkDisconnectTask);
+    // We also need to delete "session"
     Medium::close(session);
   }
 }
@@ -537,17 +1182,49 @@ StreamClientState::~StreamClientState() {
 // Define the size of the buffer that we'll use:
 #define DUMMY_SINK_RECEIVE_BUFFER_SIZE 2*1024*1024
 
-DummySink* DummySink::createNew(UsageEnvironment& env, MediaSubsession& subsession, char const* streamId, StreamCallback callback) {
-  return new DummySink(env, subsession, streamId, callback);
+// The largest batch of audio packets that we put into one frame.  (A batch of AAC is kept within "ADTS_MAX_FRAME_SIZE"
+// as well, the most that an ADTS length field describes, although each access unit in it has an ADTS header of its own.)
+#define AUDIO_BATCH_MAX_SIZE 64*1024
+
+DummySink* DummySink::createNew(UsageEnvironment& env, MediaSubsession& subsession, char const* streamId,
+                               StreamCallback callback, FrameWantedCallback wanted) {
+  return new DummySink(env, subsession, streamId, callback, wanted);
 }
 
-DummySink::DummySink(UsageEnvironment& env, MediaSubsession& subsession, char const* streamId, StreamCallback callback)
+DummySink::DummySink(UsageEnvironment& env, MediaSubsession& subsession, char const* streamId,
+                     StreamCallback callback, FrameWantedCallback wanted)
   : MediaSink(env),
     mCallback(callback),
+    mWanted(wanted),
     mSequence(0),
+    mPacketsLost(0),
+    mAudioCodec(stream::ENCODE_NONE),
+    mAudioSampleRate(subsession.rtpTimestampFrequency()),
+    mAudioChannels(subsession.numChannels()),
+    mAudioBatchPts(0),
     fSubsession(subsession) {
   fStreamId = strDup(streamId);
   fReceiveBuffer = new u_int8_t[DUMMY_SINK_RECEIVE_BUFFER_SIZE];
+    // (allocated and first touched on the connection's thread, so its pages come from that thread's numa node)
+
+  if (strcmp(subsession.mediumName(), "audio") == 0) {
+    if (strcmp(subsession.codecName(), "PCMU") == 0) {
+      mAudioCodec = stream::ENCODE_G711U;
+    } else if (strcmp(subsession.codecName(), "PCMA") == 0) {
+      mAudioCodec = stream::ENCODE_G711A;
+    } else if (strcmp(subsession.codecName(), "MPEG4-GENERIC") == 0) {
+      // RFC 3640 (e.g., "mode=AAC-hbr"): live555 delivers bare access units, so we need the AudioSpecificConfig
+      // to build their ADTS headers:
+      mAacConfig.frequencyIndex = live555client::aacFrequencyIndex(subsession.rtpTimestampFrequency());
+      mAacConfig.channelConfig = (u_int8_t)subsession.numChannels();
+      unsigned configSize = 0;
+      unsigned char* config = parseGeneralConfigStr(subsession.fmtp_config(), configSize);
+      live555client::parseAacConfig(config, configSize, mAacConfig);
+      delete[] config;
+      mAudioCodec = stream::ENCODE_AAC;
+    }
+    // (other audio codecs - e.g., "MP4A-LATM" - are received, but not output)
+  }
 }
 
 DummySink::~DummySink() {
@@ -555,6 +1232,12 @@ DummySink::~DummySink() {
   delete[] fStreamId;
 }
 
+void DummySink::stopPlaying() {
+  mFrame = stream::CFrame();
+  mAudioBatch.resize(0);
+  MediaSink::stopPlaying();
+}
+
 void DummySink::afterGettingFrame(void* clientData, unsigned frameSize, unsigned numTruncatedBytes,
 				  struct timeval presentationTime, unsigned durationInMicroseconds) {
   DummySink* sink = (DummySink*)clientData;
@@ -583,8 +1266,15 @@ void DummySink::afterGettingFrame(unsigned frameSize, unsigned numTruncatedBytes
   envir() << "\n";
 #endif
 
-  auto rtspClient = (ourRTSPClient*)fSubsession.miscPtr;
-  rtspClient->scs.disconnectCounter = 0;  // reset counter
+  auto scs = (StreamClientState*)fSubsession.miscPtr;
+  scs->lastFrameMs = monotonicMs(); // keeps the channel's liveness timer from firing
+  scs->counters->bytesReceived += frameSize;
+  bool lost = checkPacketLoss();
+
+  if (scs->keyFrameOnFirstFrame && strcmp(fSubsession.mediumName(), "video") == 0) {
+    // The server may start with P frames (e.g., in the middle of a GOP); don't make the viewer wait for the next IDR:
+    if (requestKeyFrame(scs)) scs->keyFrameOnFirstFrame = False;
+  }
 
 #if 0
     if (strcmp(fSubsession.mediumName(), "video") == 0)
@@ -628,38 +1318,39 @@ void DummySink::afterGettingFrame(unsigned frameSize, unsigned numTruncatedBytes
         {
             if (strcmp(fSubsession.codecName(), "JPEG") == 0)
             {
-                // create jpeg image frame
-                int w = fSubsession.videoWidth(), h = fSubsession.videoHeight();
-                mFrame = stream::CFrameFactory::createImageFrame(
-                            channel, streamid, w, h, pts, mSequence, stream::IMAGE_FORMAT_JPEG,
-                            frameSize + numTruncatedBytes);
-
-                uint8_t* ptr = (uint8_t*)mFrame.data();
-                memcpy(ptr, fReceiveBuffer, frameSize);
+                if (frameIntact('I', lost) && frameWanted('I', pts))
+                {
+                    // create jpeg image frame
+                    int w = fSubsession.videoWidth(), h = fSubsession.videoHeight();
+                    mFrame = stream::CFrameFactory::createImageFrame(
+                                channel, streamid, w, h, pts, mSequence, stream::IMAGE_FORMAT_JPEG,
+                                frameSize + numTruncatedBytes);
+
+                    uint8_t* ptr = (uint8_t*)mFrame.data();
+                    memcpy(ptr, fReceiveBuffer, frameSize);
+                }
             }
             else if (strcmp(fSubsession.codecName(), "H264") == 0)
             {
                 static char nalHead[] = {0x00, 0x00, 0x00, 0x01};
 
                 auto nalType = fReceiveBuffer[0] & 0x1f;
-                if (nalType == stream::NALU_TYPE_SPS) {
-                    // infof("sps comming! size(%d)\n", frameSize);
-                    mSPS.resize(0);
-                    mSPS.putBuffer(nalHead, sizeof(nalHead));
-                    mSPS.putBuffer(fReceiveBuffer, frameSize);
-                } else if (nalType == stream::NALU_TYPE_PPS) {
-                    // infof("pps comming! size(%d)\n", frameSize);
-                    mPPS.resize(0);
-                    mPPS.putBuffer(nalHead, sizeof(nalHead));
-                    mPPS.putBuffer(fReceiveBuffer, frameSize);
-                } else if (nalType == stream::NALU_TYPE_SEI) {
-                    // infof("sei comming! size(%d)\n", frameSize);
-                    mSEI.resize(0);
-                    mSEI.putBuffer(nalHead, sizeof(nalHead));
-                    mSEI.putBuffer(fReceiveBuffer, frameSize);
+                bool intact = true;
+                if (nalType == stream::NALU_TYPE_IDR || nalType == stream::NALU_TYPE_SLICE) {
+                    intact = frameIntact(nalType == stream::NALU_TYPE_IDR ? 'I' : 'P', lost);
+                } else if (lost) {
+                    // frames before this nal were lost
+                    mLossGate.lost(scs->options.dropCorruptFrames);
+                }
+
+                if (mParameterSets.store(fReceiveBuffer, frameSize)) {
+                    // sps/pps/sei: they go in front of the next wanted I frame
+                } else if (nalType == stream::NALU_TYPE_IDR && (!intact || !frameWanted('I', pts))) {
+                    // nobody wants it, keep sps/pps/sei for the next wanted I frame
+                    ++mSequence;
                 } else if (nalType == stream::NALU_TYPE_IDR) {
                     // create h264 video I frame
-                    auto totalsize = mSPS.size() + mPPS.size() + mSEI.size() + sizeof(nalHead) + frameSize + numTruncatedBytes;
+                    auto totalsize = mParameterSets.size() + sizeof(nalHead) + frameSize + numTruncatedBytes;
                     auto codec = stream::ENCODE_H264;
                     char frametype = 'I';
                     bool newformat = false;   // FIXME
@@ -669,19 +1360,13 @@ void DummySink::afterGettingFrame(unsigned frameSize, unsigned numTruncatedBytes
                               codec, frametype, totalsize);
 
                     uint8_t* ptr = (uint8_t*)mFrame.data();
-                    memcpy(ptr, mSPS.getBuffer(), mSPS.size());
-                    ptr += mSPS.size();
-                    mSPS.resize(0);
-                    memcpy(ptr, mPPS.getBuffer(), mPPS.size());
-                    ptr += mPPS.size();
-                    mPPS.resize(0);
-                    memcpy(ptr, mSEI.getBuffer(), mSEI.size());
-                    ptr += mSEI.size();
-                    mSEI.resize(0);
+                    ptr += mParameterSets.take(ptr);
                     memcpy(ptr, nalHead, sizeof(nalHead));
                     ptr += sizeof(nalHead);
                     memcpy(ptr, fReceiveBuffer, frameSize);
 
+                    ++mSequence;
+                } else if (nalType == stream::NALU_TYPE_SLICE && (!intact || !frameWanted('P', pts))) {
                     ++mSequence;
                 } else if (nalType == stream::NALU_TYPE_SLICE) {
                     // create h264 video P frame
@@ -707,7 +1392,10 @@ void DummySink::afterGettingFrame(unsigned frameSize, unsigned numTruncatedBytes
         }
         else if (strcmp(fSubsession.mediumName(), "audio") == 0)
         {
-            // TODO: create audio frame
+            if (mAudioCodec != stream::ENCODE_NONE && numTruncatedBytes == 0)
+            {
+                deliverAudio(pts, frameSize, scs->options.audioBatchMs);
+            }
         }
     }
     else
@@ -721,8 +1409,8 @@ void DummySink::afterGettingFrame(unsigned frameSize, unsigned numTruncatedBytes
         }
         else
         {
-            warnf("pos out of range! pos(%d) frameSize(%d) numTruncatedBytes(%d) FrameSize(%d)\n",
-                  pos, frameSize, numTruncatedBytes, mFrame.size());
+            rtspWarnf(&scs->logLimiter, "pos out of range! pos(%d) frameSize(%d) numTruncatedBytes(%d) FrameSize(%d)\n",
+                      pos, frameSize, numTruncatedBytes, mFrame.size());
         }
     }
 
@@ -733,18 +1421,115 @@ void DummySink::afterGettingFrame(unsigned frameSize, unsigned numTruncatedBytes
     }
   }
 
+  if (scs->throttle) {
+    // Archive mode: don't read any more while the consumer is busy.  (This blocks the event loop, and so the socket,
+    // which makes the server slow down; the connection is not shared in this mode.)
+    scs->throttle();
+    scs->lastFrameMs = monotonicMs();
+  }
+
   // Then continue, to request the next frame of data:
   continuePlaying();
 }
 
-Boolean DummySink::continuePlaying() {
-  if (fSource == NULL) return False; // sanity check (should not happen)
+void DummySink::deliverAudio(uint64_t pts, unsigned frameSize, int batchMs) {
+  u_int8_t header[live555client::ADTS_HEADER_SIZE];
+  unsigned headerSize = 0;
+  unsigned batchMaxSize = AUDIO_BATCH_MAX_SIZE;
+  if (mAudioCodec == stream::ENCODE_AAC) {
+    if (!live555client::buildAdtsHeader(header, mAacConfig, frameSize)) {
+      auto scs = (StreamClientState*)fSubsession.miscPtr;
+      rtspWarnf(&scs->logLimiter, "aac frame too large for ADTS (%u bytes), dropped\n", frameSize);
+      return;
+    }
+    headerSize = live555client::ADTS_HEADER_SIZE;
+    batchMaxSize = live555client::ADTS_MAX_FRAME_SIZE;
+  }
 
-  // Request the next frame of data from our input source.  "afterGettingFrame()" will get called later, when it arrives:
-  fSource->getNextFrame(fReceiveBuffer, DUMMY_SINK_RECEIVE_BUFFER_SIZE,
-                        afterGettingFrame, this,
-                        onSourceClosure, this);
-  return True;
+  if (batchMs > 0 && mAudioBatch.size() > 0
+      && (pts < mAudioBatchPts || pts - mAudioBatchPts >= (uint64_t)batchMs
+          || mAudioBatch.size() + headerSize + frameSize > batchMaxSize)) {
+    flushAudio();
+  }
+
+  if (mAudioBatch.size() == 0) mAudioBatchPts = pts;
+  mAudioBatch.putBuffer(header, headerSize);
+  mAudioBatch.putBuffer(fReceiveBuffer, frameSize);
+
+  if (batchMs <= 0) flushAudio();
+}
+
+void DummySink::flushAudio() {
+  if (mAudioBatch.size() == 0) return;
+
+  if (frameWanted('A', mAudioBatchPts)) {
+    int channel = 0;
+    int streamid = 0;
+    mFrame = stream::CFrameFactory::createAudioFrame(
+              channel, streamid, mAudioBatchPts, mSequence,
+              mAudioCodec, mAudioSampleRate, mAudioChannels, mAudioBatch.size());
+    memcpy(mFrame.data(), mAudioBatch.getBuffer(), mAudioBatch.size());
+  }
+
+  ++mSequence;
+  mAudioBatch.resize(0);
+}
+
+bool DummySink::frameWanted(char frametype, uint64_t pts) {
+  return !mWanted || mWanted(frametype, pts);
+}
+
+bool DummySink::checkPacketLoss() {
+  RTPSource* rtpSource = fSubsession.rtpSource();
+  if (rtpSource == NULL) return false;
+
+  // The reception stats are updated as each packet arrives, so they already cover all packets of this frame.
+  // (Packets lost inside a fragmented NAL unit make live555 drop that NAL unit, so they show up here too.)
+  unsigned lost = 0;
+  RTPReceptionStatsDB::Iterator iter(rtpSource->receptionStatsDB());
+  RTPReceptionStats* stats;
+  while ((stats = iter.next(True)) != NULL) {
+    unsigned expected = stats->totNumPacketsExpected();
+    unsigned received = stats->totNumPacketsReceived();
+    if (expected > received) lost += expected - received;
+  }
+
+  // (The count can also go down, when late packets arrive out of order.)
+  bool newLoss = lost > mPacketsLost;
+  if (newLoss) {
+    auto scs = (StreamClientState*)fSubsession.miscPtr;
+    scs->counters->packetsLost += lost - mPacketsLost;
+  }
+  mPacketsLost = lost;
+  return newLoss;
+}
+
+bool DummySink::frameIntact(char frametype, bool lost) {
+  auto scs = (StreamClientState*)fSubsession.miscPtr;
+
+  if (lost) {
+    ++scs->counters->corruptFrames;
+    // (live555 drops incomplete frames, so a loss seen by a key frame hit something before it,
+    // and this key frame is what the decoder needs to recover; don't ask for another one)
+    if (frametype != 'I' && scs->options.autoRequestKeyFrame) requestKeyFrame(scs);
+  }
+
+  if (!mLossGate.pass(frametype, lost, scs->options.dropCorruptFrames)) {
+    // drop it, and everything that refers to it, until the next clean IDR
+    ++scs->counters->droppedFrames;
+    return false;
+  }
+  return true;
+}
+
+Boolean DummySink::continuePlaying() {
+  if (fSource == NULL) return False; // sanity check (should not happen)
+
+  // Request the next frame of data from our input source.  "afterGettingFrame()" will get called later, when it arrives:
+  fSource->getNextFrame(fReceiveBuffer, DUMMY_SINK_RECEIVE_BUFFER_SIZE,
+                        afterGettingFrame, this,
+                        onSourceClosure, this);
+  return True;
 }
 
 
@@ -755,72 +1540,673 @@ Boolean DummySink::continuePlaying() {
 namespace live555client {
 
 
-CRtspStreamSource::CRtspStreamSource(const char* uri)
+namespace {
+
+
+/// 连接共用的 key: scheme://[user:pass@]host[:port]
+std::string connectionKey(char const* url)
+{
+    std::string key(url);
+    auto pos = key.find("://");
+    if (pos == std::string::npos) {
+        return key;
+    }
+
+    auto end = key.find('/', pos + 3);
+    return end == std::string::npos ? key : key.substr(0, end);
+}
+
+/// 回放下载使用独立的 TCP 连接; rtsps 的媒体数据走 TLS 连接
+RtspStreamOptions normalizeOptions(char const* url, RtspStreamOptions const& options)
+{
+    RtspStreamOptions normalized(options);
+    if (CTlsTransport::isSecureUrl(url)) {
+        normalized.streamUsingTcp = true;
+    }
+    if (!normalized.archiveStart.empty()) {
+        normalized.streamUsingTcp = true;
+        normalized.shareConnection = false;
+        normalized.onDemand = false;
+    }
+    return normalized;
+}
+
+std::mutex& connectionsMutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+std::map<std::string, std::weak_ptr<CRtspConnection> >& connections()
+{
+    static std::map<std::string, std::weak_ptr<CRtspConnection> > connections;
+    return connections;
+}
+
+/// 共用流的 key: url, 换行, 然后是所有会影响会话的选项 (回放下载不共用, 不在其中)
+std::string streamKey(char const* url, RtspStreamOptions const& options)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "\n%s %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d",
+             options.streamUsingTcp ? "tcp" : "udp", options.shareConnection, options.dropCorruptFrames,
+             options.autoRequestKeyFrame, options.keyFrameRequestFir, options.keyFrameRequestIntervalMs,
+             options.noFrameTimeoutMs, options.reconnectDelayMs, options.keepAliveIntervalMs, options.onDemand,
+             options.idleTimeoutMs, options.audioBatchMs, options.tlsVerifyPeer, options.tlsKernelOffload,
+             options.placement.numaNode, options.placement.realtimePriority, options.placement.niceValue,
+             (int)options.placement.cpus.size(), (int)options.tlsCaFile.size());
+    std::string key(url);
+    key += buf;
+    for (int cpu : options.placement.cpus) {
+        key += ' ';
+        key += std::to_string(cpu);
+    }
+    key += ' ';
+    key += options.tlsCaFile;
+    return key;
+}
+
+std::mutex& streamsMutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+std::map<std::string, std::weak_ptr<CRtspStreamSource> >& streams()
+{
+    static std::map<std::string, std::weak_ptr<CRtspStreamSource> > streams;
+    return streams;
+}
+
+
+/// 按需收流的空闲检查线程, 关闭会话要等收流线程同步, 不能在收流线程里做
+class CIdleChecker : public wize::CLoopThread
+{
+public:
+    static CIdleChecker* instance()
+    {
+        // never deleted, sources may be destroyed during static destruction
+        static CIdleChecker* checker = new CIdleChecker();
+        return checker;
+    }
+
+    void add(CRtspStreamSource* source)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mSources.push_back(source);
+    }
+
+    /// 返回后不会再检查 source
+    void remove(CRtspStreamSource* source)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mSources.erase(std::remove(mSources.begin(), mSources.end(), source), mSources.end());
+        mCond.wait(lock, [&]() { return mChecking != source; });
+    }
+
+private:
+    CIdleChecker() : wize::CLoopThread("RtspIdleCheck"), mChecking(NULL)
+    {
+        startThread();
+    }
+
+    void threadProc()
+    {
+        while (waitSignal(500) != SIGNAL_EXIT) {
+            uint64_t now = monotonicMs();
+            std::unique_lock<std::mutex> lock(mMutex);
+            for (size_t i = 0; i < mSources.size(); ++i) {
+                // checked without the lock: closing a session waits for its receive thread, whose callbacks may
+                // create or destroy other sources; remove() waits for the source being checked instead
+                mChecking = mSources[i];
+                lock.unlock();
+                mChecking->checkIdle(now);
+                lock.lock();
+                mChecking = NULL;
+                mCond.notify_all();
+            }
+        }
+    }
+
+private:
+    std::mutex                      mMutex;
+    std::condition_variable         mCond;
+    std::vector<CRtspStreamSource*> mSources;
+    CRtspStreamSource*              mChecking;  ///< 正在检查的流
+};
+
+
+} // namespace
+
+
+CRtspConnectionPtr CRtspConnection::acquire(char const* url, RtspStreamOptions const& options)
+{
+    if (!options.shareConnection) {
+        return CRtspConnectionPtr(new CRtspConnection(options.placement));
+    }
+
+    std::lock_guard<std::mutex> lock(connectionsMutex());
+    auto& registry = connections();
+    for (auto it = registry.begin(); it != registry.end(); ) {
+        if (it->second.expired()) {
+            it = registry.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    auto key = connectionKey(url);
+    auto connection = registry[key].lock();
+    if (!connection) {
+        connection.reset(new CRtspConnection(options.placement));
+        registry[key] = connection;
+    }
+    return connection;
+}
+
+CRtspConnection::CRtspConnection(ThreadPlacement const& placement)
     : wize::CLoopThread("RtspClient")
-    , mUri(uri ? uri : "")
+    , mPlacement(placement)
     , mEventLoopWatchVariable(0)
+    , mClient(NULL)
+    , mGeneration(0)
+    , mSyncedGeneration(0)
+    , mLooping(false)
+    , mStopping(false)
+    , mThreadStarted(false)
+{
+    mWakeupPipe[0] = mWakeupPipe[1] = -1;
+    if (pipe(mWakeupPipe) == 0) {
+        fcntl(mWakeupPipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(mWakeupPipe[1], F_SETFL, O_NONBLOCK);
+    } else {
+        rtspErrorf(NULL, "create wakeup pipe failed!\n");
+    }
+}
+
+CRtspConnection::~CRtspConnection()
+{
+    std::lock_guard<std::mutex> threadLock(mThreadMutex);
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+        mEventLoopWatchVariable = 1;
+    }
+    wakeup();
+    stopThread();
+
+    if (mWakeupPipe[0] >= 0) close(mWakeupPipe[0]);
+    if (mWakeupPipe[1] >= 0) close(mWakeupPipe[1]);
+}
+
+void CRtspConnection::attach(CRtspStreamSource* source)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (std::find(mChannels.begin(), mChannels.end(), source) != mChannels.end()) {
+            return;
+        }
+
+        mChannels.push_back(source);
+        ++mGeneration;
+    }
+    wakeup();
+
+    // in a callback of another channel the thread is running, and the loop opens the channel when the callback returns;
+    // (if the thread is being stopped, whoever stops it starts it again for this channel)
+    if (!inLoopThread()) {
+        controlThread();
+    }
+}
+
+void CRtspConnection::detach(CRtspStreamSource* source)
+{
+    bool inLoop = inLoopThread();
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        auto it = std::find(mChannels.begin(), mChannels.end(), source);
+        if (it == mChannels.end()) {
+            return;
+        }
+
+        mChannels.erase(it);
+        unsigned generation = ++mGeneration;
+
+        if (!inLoop) {
+            // wait for the loop to close the channel, unless it's not in the event loop (no callback can happen then)
+            wakeup();
+            mCond.wait(lock, [&]() { return !mLooping || mSyncedGeneration >= generation; });
+        }
+    }
+
+    if (inLoop) {
+        // in a callback of another channel: the loop can't sync until it returns, so close the channel right here
+        syncChannels();
+        return;
+    }
+
+    controlThread();
+}
+
+bool CRtspConnection::inLoopThread()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mLoopThread == std::this_thread::get_id();
+}
+
+void CRtspConnection::controlThread()
+{
+    std::lock_guard<std::mutex> threadLock(mThreadMutex);
+
+    // channels may come and go (also from the receive thread's callbacks) while the thread is started or stopped,
+    // so repeat until the thread matches them
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            bool wanted = !mChannels.empty();
+            if (wanted == mThreadStarted) {
+                return;
+            }
+
+            if (wanted) {
+                mStopping = false;
+            } else {
+                mStopping = true;
+                mEventLoopWatchVariable = 1;
+            }
+        }
+
+        if (!mThreadStarted) {
+            startThread();
+            mThreadStarted = true;
+        } else {
+            wakeup();
+            stopThread();
+            mThreadStarted = false;
+        }
+    }
+}
+
+void CRtspConnection::wakeup()
+{
+    char c = 0;
+    if (mWakeupPipe[1] >= 0 && write(mWakeupPipe[1], &c, 1) < 0) {
+        // pipe full, the loop is going to wake up anyway
+    }
+}
+
+void CRtspConnection::wakeupHandler(void* clientData, int /*mask*/)
+{
+    auto connection = (CRtspConnection*)clientData;
+
+    char buf[64];
+    while (read(connection->mWakeupPipe[0], buf, sizeof(buf)) > 0) {
+    }
+
+    connection->syncChannels();
+}
+
+void CRtspConnection::syncChannels()
+{
+    std::vector<CRtspStreamSource*> channels;
+    unsigned generation;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        channels = mChannels;
+        generation = mGeneration;
+    }
+
+    if (mClient != NULL) {
+        for (auto it = mLive.begin(); it != mLive.end(); ) {
+            if (std::find(channels.begin(), channels.end(), it->first) == channels.end()) {
+                closeChannel(it->second);
+                it = mLive.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        for (auto source : channels) {
+            if (mLive.count(source) == 0 && !source->mCounters.archiveFinished) {
+                mLive[source] = openChannel(mClient, source->mUri.c_str(),
+                                            boost::bind(&CRtspStreamSource::onStreamCallback, source, _1),
+                                            boost::bind(&CRtspStreamSource::onFrameWanted, source, _1, _2),
+                                            source->mOptions, &source->mCounters,
+                                            source->mOptions.onDemand ? &source->mSessionCache : NULL,
+                                            source->mOptions.archiveStart.empty()
+                                                ? ThrottleCallback() : boost::bind(&CRtspStreamSource::waitConsumer, source));
+            }
+        }
+
+        for (auto& live : mLive) {
+            if (live.first->mKeyFrameRequested.exchange(false)) {
+                requestKeyFrame(live.second);
+            }
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mSyncedGeneration = generation;
+    }
+    mCond.notify_all();
+}
+
+void CRtspConnection::threadProc()
+{
+    rtspTracef(NULL, "__begin!\n");
+    int sleepms = 0;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mLoopThread = std::this_thread::get_id();
+    }
+
+    // before anything is allocated, so that the scheduler and receive buffers are on our numa node (and so are the frame
+    // pools' pages if we grow them; memory allocated earlier by the application isn't moved)
+    applyThreadPlacement(mPlacement);
+
+    // Begin by setting up our usage environment; it's kept across reconnects (closing the client removes all of its
+    // sockets and tasks from the scheduler, and cancels its channels' timers):
+    TaskScheduler* scheduler = BasicTaskScheduler::createNew();
+    UsageEnvironment* env = LogUsageEnvironment::createNew(*scheduler);
+    LoopTimers* timers = new LoopTimers(*scheduler);
+
+    while (true) {
+      std::string uri;
+      RtspStreamOptions options;
+      {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mStopping) {
+          break;
+        }
+        // (a finished archive doesn't need the connection anymore)
+        for (auto source : mChannels) {
+          if (!source->mCounters.archiveFinished) {
+            uri = source->mUri;
+            options = source->mOptions;
+            break;
+          }
+        }
+        mEventLoopWatchVariable = 0;
+      }
+
+      // Open the connection (this fails only for "rtsps://", when the server can't be reached; retry after a while):
+      if (!uri.empty()) {
+        mClient = openConnection(*env, "RtspClient", uri.c_str(), options, *timers, &mEventLoopWatchVariable, &mClient);
+      }
+
+      if (mClient != NULL) {
+        // Start streaming every channel on the connection:
+        scheduler->turnOnBackgroundReadHandling(mWakeupPipe[0], wakeupHandler, this);
+        {
+          std::lock_guard<std::mutex> lock(mMutex);
+          mLooping = true;
+        }
+        syncChannels();
+
+        // All subsequent activity takes place within the event loop.  (live555 polls a "char volatile"; we keep an atomic,
+        // because other threads set it, and hand it over as the plain "char" that a lock-free one is laid out as.)
+        static_assert(ATOMIC_CHAR_LOCK_FREE == 2 && sizeof(std::atomic<char>) == sizeof(char),
+                      "the event loop's watch variable must be a plain char");
+        env->taskScheduler().doEventLoop(reinterpret_cast<char volatile*>(&mEventLoopWatchVariable));
+        // This function call does not return, unless, at some point in time, "mEventLoopWatchVariable" gets set to something non-zero.
+
+        {
+          std::lock_guard<std::mutex> lock(mMutex);
+          mLooping = false;
+        }
+        mCond.notify_all();
+
+        scheduler->turnOffBackgroundReadHandling(mWakeupPipe[0]);
+        if (mClient != NULL) {
+          // stopped by user (or a closed TLS connection has to be reopened), send "TEARDOWN" and close
+          shutdownStream(mClient);
+        }
+        mLive.clear();
+      }
+
+      sleepms = nextRetryDelay(sleepms, options.reconnectDelayMs);
+      rtspTracef(NULL, "wait (%d)ms to retry open rtsp client...\n", sleepms);
+      auto sig = waitSignal(sleepms);
+      if (sig == SIGNAL_EXIT) {
+        rtspTracef(NULL, "exit by user stop!\n");
+        break;
+      }
+    }
+
+    delete timers; timers = NULL;
+    env->reclaim(); env = NULL;
+    delete scheduler; scheduler = NULL;
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mLoopThread = std::thread::id();
+    }
+    rtspTracef(NULL, "__end!\n");
+}
+
+
+CRtspStreamSource::CRtspStreamSource(const char* uri, RtspStreamOptions const& options)
+    : mUri(uri ? uri : "")
+    , mOptions(normalizeOptions(uri, options))
+    , mConnection(CRtspConnection::acquire(mUri.c_str(), mOptions))
+    , mKeyFrameRequested(false)
+    , mStarts(0)
+    , mAttached(false)
+    , mDetaching(false)
+    , mAttachPending(false)
+    , mIdleSinceMs(0)
+    , mConsumerBusy(false)
+    , mConsumerReleased(false)
+    , mStatsMs(monotonicMs())
+    , mStatsBytes(0)
+    , mThroughputKbps(0)
 {
-    tracepoint();
+    rtspTracef(NULL, "%s\n", __FUNCTION__);
+    if (mOptions.onDemand) {
+        CIdleChecker::instance()->add(this);
+    }
 }
 
 CRtspStreamSource::~CRtspStreamSource()
 {
-    tracepoint();
-    stop();
+    rtspTracef(NULL, "%s\n", __FUNCTION__);
+    if (mOptions.onDemand) {
+        CIdleChecker::instance()->remove(this);
+    }
+    releaseConsumer(true);
+    mConnection->detach(this);
 }
 
 CRtspStreamSource::Connection CRtspStreamSource::connect(StreamCallback callback)
 {
-    return mSignal.connect(callback);
+    if (mOptions.autoRequestKeyFrame) {
+        requestKeyFrame();
+    }
+
+    auto connection = mFanout.connect(callback);
+    activate();
+    return connection;
+}
+
+CRtspStreamSource::Connection CRtspStreamSource::connect(StreamCallback callback, FrameFilter const& filter)
+{
+    return connect(callback, filter, CFrameFanout::WantedCallback());
+}
+
+CRtspStreamSource::Connection CRtspStreamSource::connect(StreamCallback callback, FrameFilter const& filter,
+                                                         CFrameFanout::WantedCallback wanted)
+{
+    if (mOptions.autoRequestKeyFrame) {
+        requestKeyFrame();
+    }
+
+    auto connection = mFanout.connect(callback, filter, wanted);
+    activate();
+    return connection;
 }
 
 /// 开启
 bool CRtspStreamSource::start()
 {
-    tracepoint();
-    return startThread();
+    rtspTracef(NULL, "%s\n", __FUNCTION__);
+    std::lock_guard<std::mutex> lock(mStartMutex);
+    if (mStarts++ == 0 && (!mOptions.onDemand || !mFanout.empty())) {
+        mIdleSinceMs = 0;
+        mCounters.archiveFinished = false;
+        releaseConsumer(false);
+        if (mDetaching) {
+            mAttachPending = true;
+        } else {
+            mAttached = true;
+            mConnection->attach(this);
+        }
+    }
+    return true;
 }
 
 /// 停止
 bool CRtspStreamSource::stop()
 {
-    tracepoint();
-    mEventLoopWatchVariable = 1;
-    return stopThread();
+    rtspTracef(NULL, "%s\n", __FUNCTION__);
+    std::unique_lock<std::mutex> lock(mStartMutex);
+    if (mStarts > 0 && --mStarts == 0) {
+        // an idle close in progress still has callbacks until it returns; (it waits for the receive thread, so a
+        // callback on that thread that stops us can't wait for it, and doesn't need to: it's the one that would run)
+        mAttachPending = false;
+        if (!mConnection->inLoopThread()) {
+            mDetachCond.wait(lock, [this]() { return !mDetaching; });
+        }
+    }
+    if (mStarts == 0 && mAttached) {
+        mAttached = false;
+        releaseConsumer(true);
+        mConnection->detach(this);
+    }
+    return true;
 }
 
-void CRtspStreamSource::threadProc()
+void CRtspStreamSource::activate()
 {
-    tracef("__begin!\n");
-    int sleepms = 1000;
+    if (!mOptions.onDemand) {
+        return;
+    }
 
-    while (true) {
-      mEventLoopWatchVariable = 0;
+    std::lock_guard<std::mutex> lock(mStartMutex);
+    mIdleSinceMs = 0;
+    if (mStarts > 0 && !mAttached) {
+        rtspInfof(NULL, "subscriber connected, open stream(%s)\n", mUri.c_str());
+        if (mDetaching) {
+            // (maybe called from the very callback that the idle close waits for; it re-attaches when done)
+            mAttachPending = true;
+        } else {
+            mAttached = true;
+            mConnection->attach(this);
+        }
+    }
+}
 
-      // Begin by setting up our usage environment:
-      TaskScheduler* scheduler = BasicTaskScheduler::createNew();
-      UsageEnvironment* env = BasicUsageEnvironment::createNew(*scheduler);
+void CRtspStreamSource::checkIdle(uint64_t nowMs)
+{
+    {
+        std::lock_guard<std::mutex> lock(mStartMutex);
+        if (!mAttached) {
+            return;
+        }
 
-      // Open and start streaming
-      openURL(*env, "RtspClient", mUri.c_str(), boost::bind(&CRtspStreamSource::onStreamCallback, this, _1), &mEventLoopWatchVariable);
+        if (!mFanout.empty()) {
+            mIdleSinceMs = 0;
+            return;
+        }
+        if (mIdleSinceMs == 0) {
+            mIdleSinceMs = nowMs;
+            return;
+        }
+        if (nowMs - mIdleSinceMs < (uint64_t)mOptions.idleTimeoutMs) {
+            return;
+        }
 
-      // All subsequent activity takes place within the event loop:
-      env->taskScheduler().doEventLoop(&mEventLoopWatchVariable);
-      // This function call does not return, unless, at some point in time, "mEventLoopWatchVariable" gets set to something non-zero.
+        rtspInfof(NULL, "no subscriber for %d ms, close stream(%s)\n", mOptions.idleTimeoutMs, mUri.c_str());
+        mAttached = false;
+        mDetaching = true;
+        mAttachPending = false;
+    }
 
-      env->reclaim(); env = NULL;
-      delete scheduler; scheduler = NULL;
+    // without the lock: this waits for the receive thread, whose callbacks may call connect(), start() or stop() on us
+    // or on other sources of the connection (those don't wait for the receive thread, see CRtspConnection::detach())
+    mConnection->detach(this);
 
-      sleepms = (sleepms >= 8000) ? 2000 : sleepms * 2;
-      tracef("wait (%d)ms to retry open rtsp client...\n", sleepms);
-      auto sig = waitSignal(sleepms);
-      if (sig == SIGNAL_EXIT) {
-        tracef("exit by user stop!\n");
-        break;
-      }
+    {
+        std::lock_guard<std::mutex> lock(mStartMutex);
+        mDetaching = false;
+        if (mAttachPending && mStarts > 0) {
+            rtspInfof(NULL, "subscriber connected while closing, open stream(%s)\n", mUri.c_str());
+            mIdleSinceMs = 0;
+            mAttached = true;
+            mConnection->attach(this);
+        }
+        mAttachPending = false;
     }
+    mDetachCond.notify_all();
+}
+
+RtspStreamStats CRtspStreamSource::getStats()
+{
+    RtspStreamStats stats;
+    stats.packetsLost = mCounters.packetsLost;
+    stats.corruptFrames = mCounters.corruptFrames;
+    stats.droppedFrames = mCounters.droppedFrames;
+    stats.keyFrameRequests = mCounters.keyFrameRequests;
+    stats.bytesReceived = mCounters.bytesReceived;
+    stats.archiveFinished = mCounters.archiveFinished;
+
+    std::lock_guard<std::mutex> lock(mStatsMutex);
+    uint64_t now = monotonicMs();
+    if (now - mStatsMs >= 100) {
+        // too short an interval says nothing, keep the last value then
+        mThroughputKbps = (stats.bytesReceived - mStatsBytes) * 8.0 / (now - mStatsMs);
+        mStatsMs = now;
+        mStatsBytes = stats.bytesReceived;
+    }
+    stats.throughputKbps = mThroughputKbps;
+    return stats;
+}
 
-    tracef("__end!\n");
+void CRtspStreamSource::setConsumerBusy(bool busy)
+{
+    {
+        std::lock_guard<std::mutex> lock(mFlowMutex);
+        mConsumerBusy = busy;
+    }
+    mFlowCond.notify_all();
+}
+
+void CRtspStreamSource::waitConsumer()
+{
+    std::unique_lock<std::mutex> lock(mFlowMutex);
+    mFlowCond.wait(lock, [this]() { return !mConsumerBusy || mConsumerReleased; });
+}
+
+void CRtspStreamSource::releaseConsumer(bool released)
+{
+    {
+        std::lock_guard<std::mutex> lock(mFlowMutex);
+        mConsumerReleased = released;
+    }
+    mFlowCond.notify_all();
+}
+
+bool CRtspStreamSource::requestKeyFrame()
+{
+    mKeyFrameRequested = true;
+    mConnection->wakeup();
+
+    std::lock_guard<std::mutex> lock(mStartMutex);
+    return mAttached;
+}
+
+bool CRtspStreamSource::onFrameWanted(char frametype, uint64_t pts)
+{
+    return mFanout.wanted(frametype, pts);
 }
 
 void CRtspStreamSource::onStreamCallback(stream::CFrame const& frame)
@@ -837,7 +2223,141 @@ void CRtspStreamSource::onStreamCallback(stream::CFrame const& frame)
         }
     }
 #endif
-    mSignal(frame);
+    mFanout.deliver(frame);
+}
+
+
+stream::IStreamSourcePtr CRtspStreamHandle::create(char const* url, RtspStreamOptions const& options)
+{
+    std::shared_ptr<CRtspStreamSource> source;
+    if (!options.shareStream || !options.archiveStart.empty()) {
+        source.reset(new CRtspStreamSource(url, options));
+        return stream::IStreamSourcePtr(new CRtspStreamHandle(source));
+    }
+
+    // (options that the source overrides anyway, e.g. tcp for rtsps, don't make a different stream)
+    auto key = streamKey(url, normalizeOptions(url, options));
+    auto prefix = std::string(url) + '\n';
+    bool conflict = false;
+
+    std::lock_guard<std::mutex> lock(streamsMutex());
+    auto& registry = streams();
+    for (auto it = registry.begin(); it != registry.end(); ) {
+        if (it->second.expired()) {
+            it = registry.erase(it);
+        } else {
+            if (it->first != key && it->first.compare(0, prefix.size(), prefix) == 0) {
+                conflict = true;
+            }
+            ++it;
+        }
+    }
+
+    source = registry[key].lock();
+    if (!source) {
+        if (conflict) {
+            rtspWarnf(NULL, "[URL:\"%s\"]: shared with other options than the open stream's, opening another session\n", url);
+        }
+        source.reset(new CRtspStreamSource(url, options));
+        registry[key] = source;
+    } else {
+        rtspTracef(NULL, "share stream(%s)\n", url);
+    }
+    return stream::IStreamSourcePtr(new CRtspStreamHandle(source));
+}
+
+CRtspStreamHandle::CRtspStreamHandle(std::shared_ptr<CRtspStreamSource> const& source)
+    : mSource(source)
+    , mGate(new Gate)
+    , mStarted(false)
+{
+}
+
+CRtspStreamHandle::~CRtspStreamHandle()
+{
+    stop();
+}
+
+CRtspStreamHandle::StreamCallback CRtspStreamHandle::gated(StreamCallback callback)
+{
+    GatePtr gate = mGate;
+    return [gate, callback](stream::CFrame const& frame) {
+        std::lock_guard<std::mutex> lock(gate->mutex);
+        if (gate->open) {
+            callback(frame);
+        }
+    };
+}
+
+CFrameFanout::WantedCallback CRtspStreamHandle::gated(CFrameFanout::WantedCallback wanted)
+{
+    GatePtr gate = mGate;
+    return [gate, wanted](char frametype, uint64_t pts) {
+        return gate->open && (!wanted || wanted(frametype, pts));
+    };
+}
+
+CRtspStreamHandle::Connection CRtspStreamHandle::connect(StreamCallback callback)
+{
+    // (a subscriber with an empty filter gets every frame, like a plain one, but only while this handle is started)
+    return mSource->connect(gated(callback), FrameFilter(), gated(CFrameFanout::WantedCallback()));
+}
+
+CRtspStreamHandle::Connection CRtspStreamHandle::connect(StreamCallback callback, FrameFilter const& filter)
+{
+    return mSource->connect(gated(callback), filter, gated(CFrameFanout::WantedCallback()));
+}
+
+CRtspStreamHandle::Connection CRtspStreamHandle::connect(StreamCallback callback, FrameFilter const& filter,
+                                                         CFrameFanout::WantedCallback wanted)
+{
+    return mSource->connect(gated(callback), filter, gated(wanted));
+}
+
+bool CRtspStreamHandle::start()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mStarted) {
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> gateLock(mGate->mutex);
+        mGate->open = true;
+    }
+    mStarted = true;
+    return mSource->start();
+}
+
+bool CRtspStreamHandle::stop()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mStarted) {
+        return true;
+    }
+
+    {
+        // waits for a callback in progress
+        std::lock_guard<std::mutex> gateLock(mGate->mutex);
+        mGate->open = false;
+    }
+    mStarted = false;
+    return mSource->stop();
+}
+
+RtspStreamStats CRtspStreamHandle::getStats()
+{
+    return mSource->getStats();
+}
+
+bool CRtspStreamHandle::requestKeyFrame()
+{
+    return mSource->requestKeyFrame();
+}
+
+void CRtspStreamHandle::setConsumerBusy(bool busy)
+{
+    mSource->setConsumerBusy(busy);
 }
 
 
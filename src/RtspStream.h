@@ -2,46 +2,252 @@
 #define __APP_RTSP_CLIENT_IMPL_H__
 
 
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <boost/bind.hpp>
 #include "wize/LoopThread.h"
 #include "wize/Component.h"
 #include "stream/EncodeSpecific.h"
 #include "stream/StreamSource.h"
+#include "live555client/Live555Client.h"
+#include "FrameFanout.h"
+
+
+class ourRTSPClient;
+class StreamClientState;
 
 
 namespace live555client {
 
 
-class CRtspStreamSource : public stream::IStreamSource, public wize::CLoopThread
+class CRtspStreamSource;
+class CRtspConnection;
+
+
+/// 收流线程更新, 其它线程读取的统计计数
+struct StreamCounters
+{
+    std::atomic<uint64_t>   packetsLost;
+    std::atomic<uint64_t>   corruptFrames;
+    std::atomic<uint64_t>   droppedFrames;
+    std::atomic<uint64_t>   keyFrameRequests;
+    std::atomic<uint64_t>   bytesReceived;
+    std::atomic<bool>       archiveFinished;
+
+    StreamCounters()
+        : packetsLost(0), corruptFrames(0), droppedFrames(0), keyFrameRequests(0)
+        , bytesReceived(0), archiveFinished(false) {}
+};
+
+/// 上次建立会话时的 SDP, 按需收流重新建立会话时跳过 DESCRIBE; 只在收流线程里访问
+struct SessionCache
+{
+    std::string sdp;
+    std::string baseUrl;
+};
+
+typedef std::shared_ptr<CRtspConnection> CRtspConnectionPtr;
+
+
+/// 一条 rtsp 连接和它的收流线程, 可以被多路流共用 (NVR 多通道)
+/// 所有 live555 对象只在收流线程里访问, 其它线程通过唤醒管道通知收流线程同步通道列表
+class CRtspConnection : public wize::CLoopThread
+{
+public:
+    /// options.shareConnection 为 true 时, 同一 host:port 和用户名密码的 url 返回同一个连接
+    static CRtspConnectionPtr acquire(char const* url, RtspStreamOptions const& options);
+
+    ~CRtspConnection();
+
+    /// 加入一路流, 收流线程没有运行则启动; 可以在该连接其它流的回调里调用
+    void attach(CRtspStreamSource* source);
+
+    /// 移除一路流, 返回后不会再有该流的回调; 最后一路流移除后停止收流线程
+    /// 可以在该连接其它流的回调里调用, 这时直接关闭该流, 不等待, 收流线程留到下一次在收流线程外的 attach/detach 再停止
+    /// 注意: 不能在该流自己的回调里调用
+    void detach(CRtspStreamSource* source);
+
+    /// 当前线程是否该连接的收流线程 (在它的回调里)
+    bool inLoopThread();
+
+    /// 唤醒收流线程, 处理通道变化和关键帧请求
+    void wakeup();
+
+private:
+    CRtspConnection(CRtspConnection const&);
+    CRtspConnection& operator=(CRtspConnection const&);
+
+    CRtspConnection(ThreadPlacement const& placement);
+
+    void threadProc();
+    static void wakeupHandler(void* clientData, int mask);
+    void syncChannels();
+
+    /// 按有没有流启动或停止收流线程, 不在收流线程里调用
+    void controlThread();
+
+private:
+    ThreadPlacement         mPlacement;
+    std::atomic<char>       mEventLoopWatchVariable;    ///< 非 0 时收流线程退出事件循环; 别的线程置位后要 wakeup()
+    int                     mWakeupPipe[2];
+
+    /// 只在收流线程里访问
+    ourRTSPClient*          mClient;
+    std::map<CRtspStreamSource*, StreamClientState*> mLive;
+
+    std::mutex              mMutex;
+    std::condition_variable mCond;
+    std::vector<CRtspStreamSource*> mChannels;
+    unsigned                mGeneration;
+    unsigned                mSyncedGeneration;
+    bool                    mLooping;       ///< 收流线程在 doEventLoop 里
+    bool                    mStopping;      ///< 收流线程要退出
+    std::thread::id         mLoopThread;
+
+    std::mutex              mThreadMutex;   ///< 只保护收流线程的启停, 不在持有它时等待收流线程同步
+    bool                    mThreadStarted;
+};
+
+
+class CRtspStreamSource : public IRtspStreamSource
 {
 public:
-    CRtspStreamSource(const char* uri);
+    CRtspStreamSource(const char* uri, RtspStreamOptions const& options);
 
     ~CRtspStreamSource();
 
     Connection connect(StreamCallback);
 
-    /// 开启
+    /// 带过滤条件订阅
+    Connection connect(StreamCallback callback, FrameFilter const& filter);
+
+    /// 带过滤条件订阅, 另外由 wanted 在组帧之前判断要不要
+    Connection connect(StreamCallback callback, FrameFilter const& filter, CFrameFanout::WantedCallback wanted);
+
+    /// 开启, 引用计数, 和 stop() 成对调用
     bool start();
 
-    /// 停止
+    /// 停止, 最后一个 start() 对应的 stop() 才真正停止
     bool stop();
 
+    /// 取统计
+    RtspStreamStats getStats();
+
+    /// 请求关键帧, 有会话时返回 true
+    bool requestKeyFrame();
+
+    /// 按需收流时由空闲检查线程定时调用, 没有订阅者超过 idleTimeoutMs 后关闭会话
+    void checkIdle(uint64_t nowMs);
+
+    /// 回放下载的流控
+    void setConsumerBusy(bool busy);
+
 private:
     CRtspStreamSource(CRtspStreamSource const&);
     CRtspStreamSource& operator=(CRtspStreamSource const&);
 
-    void threadProc();
+    friend class CRtspConnection;
+
+    bool onFrameWanted(char frametype, uint64_t pts);
     void onStreamCallback(stream::CFrame const& frame);
 
+    /// 收流线程里调用, 消费者忙时等待; stop() 会让它立即返回
+    void waitConsumer();
+
+    /// 让 waitConsumer() 不再等待, 停止前调用
+    void releaseConsumer(bool released);
+
+    /// 按需收流时有了订阅者, 已经 start() 的话建立会话
+    void activate();
+
+private:
+    std::string         mUri;
+    RtspStreamOptions   mOptions;
+    CRtspConnectionPtr  mConnection;
+    StreamCounters      mCounters;
+    std::atomic<bool>   mKeyFrameRequested;
+    CFrameFanout        mFanout;
+    std::mutex          mStartMutex;
+    int                 mStarts;    ///< start() 的次数
+    bool                mAttached;  ///< 已经加入连接 (有会话)
+    bool                mDetaching; ///< 空闲检查正在不持锁地移出连接 (要等收流线程, 它的回调可能调用 connect()/start())
+    bool                mAttachPending; ///< 移出期间又需要会话, 移出完成后再加入
+    std::condition_variable mDetachCond;
+    uint64_t            mIdleSinceMs;   ///< 没有订阅者的开始时间, 0 表示有订阅者
+    SessionCache        mSessionCache;
+    std::mutex          mFlowMutex;
+    std::condition_variable mFlowCond;
+    bool                mConsumerBusy;
+    bool                mConsumerReleased;
+    std::mutex          mStatsMutex;
+    uint64_t            mStatsMs;       ///< 上一次 getStats() 的时间
+    uint64_t            mStatsBytes;    ///< 上一次 getStats() 时的 bytesReceived
+    double              mThroughputKbps;
+};
+
+
+/// createRtspStream() 返回的句柄, url 和选项相同的句柄共用一个 CRtspStreamSource (options.shareStream)
+/// 每个句柄单独开启停止: 第一个句柄 start() 时开始收流, 最后一个句柄 stop() 时停止
+/// 句柄停止后不再回调它的订阅者, 即使共用的流还在运行
+class CRtspStreamHandle : public IRtspStreamSource
+{
+public:
+    static stream::IStreamSourcePtr create(char const* url, RtspStreamOptions const& options);
+
+    ~CRtspStreamHandle();
+
+    Connection connect(StreamCallback);
+
+    Connection connect(StreamCallback callback, FrameFilter const& filter);
+
+    /// 带过滤条件订阅, 另外由 wanted 在组帧之前判断要不要 (多码流用它让不输出的码流不组帧)
+    Connection connect(StreamCallback callback, FrameFilter const& filter, CFrameFanout::WantedCallback wanted);
+
+    bool start();
+
+    /// 返回后不会再有该句柄订阅者的回调, 不能在流回调里调用
+    bool stop();
+
+    RtspStreamStats getStats();
+
+    bool requestKeyFrame();
+
+    void setConsumerBusy(bool busy);
+
 private:
-    std::string     mUri;
-    char volatile   mEventLoopWatchVariable;
-    Signal          mSignal;
+    CRtspStreamHandle(CRtspStreamHandle const&);
+    CRtspStreamHandle& operator=(CRtspStreamHandle const&);
+
+    explicit CRtspStreamHandle(std::shared_ptr<CRtspStreamSource> const& source);
+
+    /// 句柄订阅者的开关, 回调时持有锁, 关闭后可以确认没有正在进行的回调
+    /// 组帧之前不加锁读 open, 关闭的句柄的订阅者不算要这一帧
+    struct Gate
+    {
+        std::mutex  mutex;
+        std::atomic<bool> open;
+
+        Gate() : open(false) {}
+    };
+    typedef std::shared_ptr<Gate> GatePtr;
+
+    StreamCallback gated(StreamCallback callback);
+
+    CFrameFanout::WantedCallback gated(CFrameFanout::WantedCallback wanted);
+
+private:
+    std::shared_ptr<CRtspStreamSource> mSource;
+    GatePtr             mGate;
+    std::mutex          mMutex;
+    bool                mStarted;
 };
 
 
 } // namespace rtsp
 
 #endif // __APP_RTSP_CLIENT_IMPL_H__
-
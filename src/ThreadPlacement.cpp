@@ -0,0 +1,105 @@
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "RtspLog.h"
+#include "ThreadPlacement.h"
+
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+
+namespace live555client {
+
+
+namespace {
+
+
+/// 从 sysfs 查 CPU 所在的 NUMA 节点, 查不到返回 -1
+int numaNodeOfCpu(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int node = -1;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+
+
+} // namespace
+
+
+void applyThreadPlacement(ThreadPlacement const& placement)
+{
+    if (!placement.cpus.empty()) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (auto cpu : placement.cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &cpuset);
+            }
+        }
+
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        if (ret != 0) {
+            rtspWarnf(NULL, "set cpu affinity failed! err(%d)\n", ret);
+        }
+    }
+
+    int node = placement.numaNode;
+    if (node < 0 && !placement.cpus.empty()) {
+        node = numaNodeOfCpu(placement.cpus.front());
+    }
+
+    if (node >= 0) {
+        // MPOL_PREFERRED falls back to other nodes when the preferred one is out of memory
+        unsigned long mask[4] = {0};
+        if (node < (int)(sizeof(mask) * 8)) {
+            mask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+            if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) != 0) {
+                rtspWarnf(NULL, "set numa node(%d) memory policy failed! errno(%d)\n", node, errno);
+            }
+        }
+    }
+
+    if (placement.realtimePriority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = placement.realtimePriority;
+
+        int ret = pthread_setschedparam(pthread_self(), SCHED_RR, &param);
+        if (ret != 0) {
+            rtspWarnf(NULL, "set realtime priority(%d) failed! err(%d)\n", placement.realtimePriority, ret);
+        }
+    } else if (placement.niceValue != 0) {
+        // on linux the nice value is per thread
+        if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), placement.niceValue) != 0) {
+            rtspWarnf(NULL, "set nice(%d) failed! errno(%d)\n", placement.niceValue, errno);
+        }
+    }
+}
+
+
+} // namespace live555client
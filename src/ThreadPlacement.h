@@ -0,0 +1,18 @@
+#ifndef __APP_RTSP_CLIENT_THREAD_PLACEMENT_H__
+#define __APP_RTSP_CLIENT_THREAD_PLACEMENT_H__
+
+
+#include "live555client/Live555Client.h"
+
+
+namespace live555client {
+
+
+/// 在当前线程上应用 CPU 绑定, NUMA 内存策略和调度优先级, 部分失败只打日志
+/// 之后该线程首次访问的内存 (接收缓冲, 帧内存池扩容) 会优先分配在指定的 NUMA 节点上, 已经分配的内存不迁移
+void applyThreadPlacement(ThreadPlacement const& placement);
+
+
+} // namespace live555client
+
+#endif // __APP_RTSP_CLIENT_THREAD_PLACEMENT_H__
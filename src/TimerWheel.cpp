@@ -0,0 +1,233 @@
+
+#include "TimerWheel.h"
+
+
+namespace live555client {
+
+
+CTimerWheel::CTimerWheel(unsigned tickMs, uint64_t nowMs)
+    : mTickMs(tickMs > 0 ? tickMs : 1)
+    , mNowMs(nowMs)
+    , mTick(0)
+    , mStartMs(nowMs)
+    , mCount(0)
+    , mNextTick(0)
+    , mNextValid(false)
+    , mDestroyed(NULL)
+{
+    for (int level = 0; level < LEVELS; ++level) {
+        mOccupied[level] = 0;
+    }
+    for (int level = 0; level < LEVELS; ++level) {
+        for (int slot = 0; slot < SLOTS; ++slot) {
+            Timer& head = mSlots[level][slot];
+            head.mPrev = head.mNext = &head;
+        }
+    }
+}
+
+CTimerWheel::~CTimerWheel()
+{
+    if (mDestroyed != NULL) {
+        *mDestroyed = true;
+    }
+
+    // detach whatever is left, so that the owners see their timers as not armed
+    for (int level = 0; level < LEVELS; ++level) {
+        for (int slot = 0; slot < SLOTS; ++slot) {
+            Timer& head = mSlots[level][slot];
+            while (head.mNext != &head) {
+                cancel(*head.mNext);
+            }
+        }
+    }
+}
+
+void CTimerWheel::armAt(Timer& timer, uint64_t expiresMs, TimerFunc* func, void* clientData)
+{
+    cancel(timer);
+
+    uint64_t tick = expiresMs > mStartMs ? (expiresMs - mStartMs + mTickMs - 1) / mTickMs : 0;
+    timer.mExpires = tick > mTick ? tick : mTick + 1;
+    timer.mFunc = func;
+    timer.mClientData = clientData;
+    insert(timer);
+    ++mCount;
+
+    if (mNextValid && timer.mExpires < mNextTick) {
+        mNextTick = timer.mExpires;
+    }
+}
+
+void CTimerWheel::cancel(Timer& timer)
+{
+    if (!timer.armed()) {
+        return;
+    }
+
+    unlink(timer);
+    --mCount;
+
+    if (mNextValid && timer.mExpires == mNextTick) {
+        // (maybe another timer has the same expiry; look again when asked)
+        mNextValid = false;
+    }
+}
+
+void CTimerWheel::unlink(Timer& timer)
+{
+    timer.mPrev->mNext = timer.mNext;
+    timer.mNext->mPrev = timer.mPrev;
+
+    Timer& head = mSlots[timer.mSlot / SLOTS][timer.mSlot % SLOTS];
+    if (head.mNext == &head) {
+        mOccupied[timer.mSlot / SLOTS] &= ~((uint64_t)1 << (timer.mSlot % SLOTS));
+    }
+    timer.mPrev = timer.mNext = NULL;
+}
+
+bool CTimerWheel::nextExpiry(uint64_t& expiresMs) const
+{
+    if (mCount == 0) {
+        return false;
+    }
+
+    if (!mNextValid) {
+        // the slots of a level, from the one after the current tick on, hold ever later timers; (the current slot of an
+        // upper level has already been cascaded, what's in it now comes a whole round later) so the earliest timer of
+        // each level is in its first occupied slot; timers of the upper levels may still expire before those of level 0
+        uint64_t next = UINT64_MAX;
+        for (int level = 0; level < LEVELS; ++level) {
+            uint64_t occupied = mOccupied[level];
+            if (occupied == 0) {
+                continue;
+            }
+
+            int start = (int)(((mTick >> (SLOT_BITS * level)) + 1) & SLOT_MASK);
+            uint64_t rotated = start == 0 ? occupied : (occupied >> start) | (occupied << (SLOTS - start));
+            int slot = (start + __builtin_ctzll(rotated)) & SLOT_MASK;
+
+            earliest(level, slot, next);
+
+            // timers parked beyond the wheel's range sit in one of the last two slots of the top level, by their parking
+            // tick, not by their expiry; the current slot may then hold a timer that expires before them
+            int current = (start - 1) & SLOT_MASK;
+            if (level == LEVELS - 1 && slot != current && (occupied & ((uint64_t)1 << current)) != 0) {
+                earliest(level, current, next);
+            }
+        }
+
+        mNextTick = next;
+        mNextValid = true;
+    }
+
+    expiresMs = mStartMs + mNextTick * mTickMs;
+    return true;
+}
+
+void CTimerWheel::earliest(int level, int slot, uint64_t& expires) const
+{
+    Timer const& head = mSlots[level][slot];
+    for (Timer const* timer = head.mNext; timer != &head; timer = timer->mNext) {
+        if (timer->mExpires < expires) {
+            expires = timer->mExpires;
+        }
+    }
+}
+
+void CTimerWheel::insert(Timer& timer)
+{
+    uint64_t delta = timer.mExpires - mTick;
+    uint64_t slotTick = timer.mExpires;
+    uint64_t const maxDelta = ((uint64_t)1 << (SLOT_BITS * LEVELS)) - 1;
+    if (delta > maxDelta) {
+        // too far away: park it in the farthest slot, keeping its expiry, it's re-inserted when cascaded
+        delta = maxDelta;
+        slotTick = mTick + delta;
+    }
+
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1)))) {
+        ++level;
+    }
+
+    int slot = (int)((slotTick >> (SLOT_BITS * level)) & SLOT_MASK);
+    Timer& head = mSlots[level][slot];
+    timer.mSlot = level * SLOTS + slot;
+    mOccupied[level] |= (uint64_t)1 << slot;
+    timer.mPrev = head.mPrev;
+    timer.mNext = &head;
+    head.mPrev->mNext = &timer;
+    head.mPrev = &timer;
+}
+
+void CTimerWheel::cascade(int level)
+{
+    int slot = (int)((mTick >> (SLOT_BITS * level)) & SLOT_MASK);
+    Timer& head = mSlots[level][slot];
+    if (head.mNext == &head) {
+        return;
+    }
+
+    // take the whole list first, timers may land in the same slot again
+    Timer* first = head.mNext;
+    Timer* last = head.mPrev;
+    head.mPrev = head.mNext = &head;
+    mOccupied[level] &= ~((uint64_t)1 << slot);
+    last->mNext = NULL;
+
+    for (Timer* timer = first; timer != NULL; ) {
+        Timer* next = timer->mNext;
+        timer->mPrev = timer->mNext = NULL;
+        insert(*timer);
+        timer = next;
+    }
+}
+
+void CTimerWheel::advance(uint64_t nowMs)
+{
+    if (nowMs < mNowMs) {
+        return;
+    }
+    mNowMs = nowMs;
+
+    // a callback may destroy us (e.g. by closing the connection that owns us)
+    bool destroyed = false;
+    bool* outer = mDestroyed;
+    mDestroyed = &destroyed;
+
+    uint64_t target = (nowMs - mStartMs) / mTickMs;
+    if (mCount == 0) {
+        // nothing to run, skip the idle ticks
+        mTick = target;
+    }
+    while (mTick < target) {
+        ++mTick;
+
+        // when a lower level wraps, move the next slot of the level above down
+        for (int level = 1; level < LEVELS; ++level) {
+            if ((mTick & (((uint64_t)1 << (SLOT_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            cascade(level);
+        }
+
+        Timer& head = mSlots[0][mTick & SLOT_MASK];
+        while (head.mNext != &head) {
+            Timer* timer = head.mNext;
+            cancel(*timer);     // (the earliest expiry is looked up again when asked)
+            timer->mFunc(timer->mClientData);
+            if (destroyed) {
+                if (outer != NULL) {
+                    *outer = true;
+                }
+                return;
+            }
+        }
+    }
+
+    mDestroyed = outer;
+}
+
+
+} // namespace live555client
@@ -0,0 +1,90 @@
+#ifndef __APP_RTSP_CLIENT_TIMER_WHEEL_H__
+#define __APP_RTSP_CLIENT_TIMER_WHEEL_H__
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace live555client {
+
+
+/// 分层时间轮, 定时器嵌入在使用者的对象里, 启动和取消都是 O(1)
+/// 4 层, 每层 64 个槽, 不加锁, 只在一个线程 (收流线程) 里使用
+/// 不需要按固定间隔推进: 用 nextExpiry() 得到最近的到期时间, 到时再 advance()
+/// 最近的到期时间是缓存的, 只有它被取消或到期后才按每层的占用位图重新查找, 只看每层第一个非空槽
+class CTimerWheel
+{
+public:
+    typedef void (TimerFunc)(void* clientData);
+
+    /// 定时器节点, 析构前必须取消
+    class Timer
+    {
+    public:
+        Timer() : mPrev(NULL), mNext(NULL), mExpires(0), mSlot(0), mFunc(NULL), mClientData(NULL) {}
+
+        bool armed() const { return mPrev != NULL; }
+
+    private:
+        friend class CTimerWheel;
+        Timer(Timer const&);
+        Timer& operator=(Timer const&);
+
+        Timer*      mPrev;
+        Timer*      mNext;
+        uint64_t    mExpires;   ///< 到期的 tick
+        unsigned    mSlot;      ///< 所在的槽, level * SLOTS + slot
+        TimerFunc*  mFunc;
+        void*       mClientData;
+    };
+
+    CTimerWheel(unsigned tickMs, uint64_t nowMs);
+
+    ~CTimerWheel();
+
+    /// 启动定时器, 在 expiresMs (和 advance() 同一个时钟) 之后到期, 已启动的会先取消; 向上取整到 tick
+    void armAt(Timer& timer, uint64_t expiresMs, TimerFunc* func, void* clientData);
+
+    /// 取消定时器, 没启动的忽略
+    void cancel(Timer& timer);
+
+    /// 推进到 nowMs, 执行到期的定时器; 回调里可以启动和取消定时器, 也可以析构时间轮本身
+    void advance(uint64_t nowMs);
+
+    /// 最近的到期时间, 没有启动的定时器时返回 false
+    bool nextExpiry(uint64_t& expiresMs) const;
+
+    /// 启动的定时器个数
+    size_t size() const { return mCount; }
+
+    unsigned tickMs() const { return mTickMs; }
+
+private:
+    CTimerWheel(CTimerWheel const&);
+    CTimerWheel& operator=(CTimerWheel const&);
+
+    enum { LEVELS = 4, SLOT_BITS = 6, SLOTS = 1 << SLOT_BITS, SLOT_MASK = SLOTS - 1 };
+
+    void insert(Timer& timer);
+    void unlink(Timer& timer);
+    void earliest(int level, int slot, uint64_t& expires) const;
+    void cascade(int level);
+
+private:
+    unsigned    mTickMs;
+    uint64_t    mNowMs;
+    uint64_t    mTick;
+    uint64_t    mStartMs;
+    size_t      mCount;
+    uint64_t    mOccupied[LEVELS];      ///< 每层非空槽的位图
+    mutable uint64_t mNextTick;         ///< 最近的到期 tick, mNextValid 时有效
+    mutable bool mNextValid;
+    bool*       mDestroyed;             ///< advance() 执行中时指向它的局部变量
+    Timer       mSlots[LEVELS][SLOTS];  ///< 每个槽是一个带哨兵的双向循环链表
+};
+
+
+} // namespace live555client
+
+#endif // __APP_RTSP_CLIENT_TIMER_WHEEL_H__
@@ -0,0 +1,539 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <chrono>
+#include <memory>
+#if LIVE555CLIENT_WITH_RTSPS
+#include <linux/tls.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+#include "RtspLog.h"
+#include "TlsTransport.h"
+
+
+namespace live555client {
+
+
+namespace {
+
+
+/// rtsps 的默认端口 (RFC 2326)
+unsigned short const RTSPS_DEFAULT_PORT = 322;
+
+/// 连接加握手的超时, 期间收流线程被阻塞
+int const TLS_CONNECT_TIMEOUT_MS = 5000;
+
+/// finish() 等待剩余数据发出的超时, 期间收流线程被阻塞
+int const TLS_FINISH_TIMEOUT_MS = 500;
+
+char const SECURE_SCHEME[] = "rtsps://";
+
+
+uint64_t monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// 拆分 rtsps://[user:pass@]host[:port][/path], host 不含 ipv6 的方括号
+bool parseSecureUrl(char const* url, std::string& userinfo, std::string& host, unsigned short& port, std::string& path)
+{
+    if (!CTlsTransport::isSecureUrl(url)) {
+        return false;
+    }
+
+    std::string rest(url + sizeof(SECURE_SCHEME) - 1);
+    auto end = rest.find_first_of("/?");
+    std::string authority = rest.substr(0, end);
+    path = end == std::string::npos ? std::string() : rest.substr(end);
+
+    auto at = authority.rfind('@');
+    userinfo = at == std::string::npos ? std::string() : authority.substr(0, at + 1);
+    std::string hostport = at == std::string::npos ? authority : authority.substr(at + 1);
+
+    std::string portstr;
+    if (!hostport.empty() && hostport[0] == '[') {
+        auto close = hostport.find(']');
+        if (close == std::string::npos) {
+            return false;
+        }
+        host = hostport.substr(1, close - 1);
+        if (close + 1 < hostport.size() && hostport[close + 1] == ':') {
+            portstr = hostport.substr(close + 2);
+        }
+    } else {
+        auto colon = hostport.find(':');
+        host = hostport.substr(0, colon);
+        if (colon != std::string::npos) {
+            portstr = hostport.substr(colon + 1);
+        }
+    }
+
+    port = RTSPS_DEFAULT_PORT;
+    if (!portstr.empty()) {
+        int value = atoi(portstr.c_str());
+        if (value <= 0 || value > 65535) {
+            return false;
+        }
+        port = (unsigned short)value;
+    }
+    return !host.empty();
+}
+
+#if LIVE555CLIENT_WITH_RTSPS
+/// 等待 socket 可读/可写, 超时或出错返回 false
+bool waitSocket(int fd, short events, uint64_t deadline)
+{
+    while (true) {
+        uint64_t now = monotonicMs();
+        if (now >= deadline) {
+            return false;
+        }
+
+        struct pollfd pfd = { fd, events, 0 };
+        int ret = poll(&pfd, 1, (int)(deadline - now));
+        if (ret > 0) {
+            return true;
+        }
+        if (ret < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+bool sendAll(int fd, char const* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+std::string sslErrorString()
+{
+    char buf[256] = "";
+    unsigned long err = ERR_get_error();
+    if (err != 0) {
+        ERR_error_string_n(err, buf, sizeof(buf));
+    }
+    return buf;
+}
+#endif // LIVE555CLIENT_WITH_RTSPS
+
+
+} // namespace
+
+
+bool CTlsTransport::isSecureUrl(char const* url)
+{
+    return url != NULL && strncasecmp(url, SECURE_SCHEME, sizeof(SECURE_SCHEME) - 1) == 0;
+}
+
+std::string CTlsTransport::plainUrl(char const* url)
+{
+    std::string userinfo, host, path;
+    unsigned short port = 0;
+    if (!parseSecureUrl(url, userinfo, host, port, path)) {
+        return url != NULL ? url : "";
+    }
+
+    char portstr[16];
+    snprintf(portstr, sizeof(portstr), ":%u", port);
+    bool ipv6 = host.find(':') != std::string::npos;
+    return "rtsp://" + userinfo + (ipv6 ? "[" + host + "]" : host) + portstr + path;
+}
+
+CTlsTransport* CTlsTransport::open(char const* url, RtspStreamOptions const& options)
+{
+    std::string userinfo, host, path;
+    unsigned short port = 0;
+    if (!parseSecureUrl(url, userinfo, host, port, path)) {
+        rtspErrorf(NULL, "invalid rtsps url!\n");
+        return NULL;
+    }
+
+#if !LIVE555CLIENT_WITH_RTSPS
+    (void)options;
+    rtspErrorf(NULL, "rtsps is not supported, built without LIVE555CLIENT_WITH_RTSPS!\n");
+    return NULL;
+#else
+    std::unique_ptr<CTlsTransport> transport(new CTlsTransport());
+    if (!transport->handshake(host.c_str(), port, options)) {
+        return NULL;
+    }
+
+    if (!transport->kernelOffload() && !transport->startRelay()) {
+        return NULL;
+    }
+
+    rtspInfof(NULL, "tls connected to %s:%u (%s)\n", host.c_str(), port,
+              transport->kernelOffload() ? "kernel tls" : "relay");
+    return transport.release();
+#endif
+}
+
+CTlsTransport::CTlsTransport()
+    : wize::CLoopThread("RtspTls")
+    , mCtx(NULL)
+    , mSsl(NULL)
+    , mSocket(-1)
+    , mRelaySocket(-1)
+    , mClientSocket(-1)
+    , mDraining(false)
+    , mFinished(false)
+{
+}
+
+void CTlsTransport::finish()
+{
+#if LIVE555CLIENT_WITH_RTSPS
+    if (mRelaySocket >= 0) {
+        // the relay reads what RTSPClient has written up to here, then sees EOF and sends "close_notify";
+        // what still arrives from the server can't be delivered anymore
+        mDraining = true;
+        shutdown(mClientSocket, SHUT_RDWR);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCond.wait_for(lock, std::chrono::milliseconds(TLS_FINISH_TIMEOUT_MS), [this] { return mFinished; });
+        return;
+    }
+
+#ifdef TLS_SET_RECORD_TYPE
+    // with kernel TLS, RTSPClient's requests are already encrypted and queued in order; the alert is sent as a record
+    // of its own type (level warning, "close_notify")
+    if (mClientSocket >= 0) {
+        unsigned char alert[2] = { 1, 0 };
+        char control[CMSG_SPACE(sizeof(unsigned char))];
+        struct iovec iov = { alert, sizeof(alert) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_TLS;
+        cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+        *CMSG_DATA(cmsg) = 21; // alert
+        sendmsg(mClientSocket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+#endif
+#endif
+}
+
+CTlsTransport::~CTlsTransport()
+{
+    // wake the relay thread up, wherever it waits (unless finish() has let it end already)
+    if (mRelaySocket >= 0) {
+        shutdown(mRelaySocket, SHUT_RDWR);
+        if (mSocket >= 0) {
+            shutdown(mSocket, SHUT_RDWR);
+        }
+        stopThread();
+        close(mRelaySocket);
+    }
+
+#if LIVE555CLIENT_WITH_RTSPS
+    if (mSsl != NULL) {
+        SSL_free(mSsl);
+    }
+    if (mCtx != NULL) {
+        SSL_CTX_free(mCtx);
+    }
+#endif
+    if (mSocket >= 0) {
+        close(mSocket);
+    }
+}
+
+#if LIVE555CLIENT_WITH_RTSPS
+bool CTlsTransport::handshake(char const* host, unsigned short port, RtspStreamOptions const& options)
+{
+    uint64_t deadline = monotonicMs() + TLS_CONNECT_TIMEOUT_MS;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[8];
+    snprintf(service, sizeof(service), "%u", port);
+    struct addrinfo* result = NULL;
+    int ret = getaddrinfo(host, service, &hints, &result);
+    if (ret != 0) {
+        rtspErrorf(NULL, "resolve %s failed! %s\n", host, gai_strerror(ret));
+        return false;
+    }
+
+    for (auto ai = result; ai != NULL && mSocket < 0; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0
+            || (errno == EINPROGRESS && waitSocket(fd, POLLOUT, deadline)
+                && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)) {
+            mSocket = fd;
+        } else {
+            close(fd);
+        }
+    }
+    freeaddrinfo(result);
+
+    if (mSocket < 0) {
+        rtspErrorf(NULL, "connect %s:%u failed!\n", host, port);
+        return false;
+    }
+
+    mCtx = SSL_CTX_new(TLS_client_method());
+    if (mCtx == NULL) {
+        rtspErrorf(NULL, "create tls context failed! %s\n", sslErrorString().c_str());
+        return false;
+    }
+
+    SSL_CTX_set_min_proto_version(mCtx, TLS1_2_VERSION);
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    if (options.tlsKernelOffload) {
+        // the kernel can only take over a TLS 1.2 connection completely, see below
+        SSL_CTX_set_max_proto_version(mCtx, TLS1_2_VERSION);
+    }
+    SSL_CTX_set_options(mCtx, SSL_OP_ENABLE_KTLS);
+#else
+    if (options.tlsKernelOffload) {
+        // (without kTLS, capping the version would only lose TLS 1.3)
+        rtspInfof(NULL, "tls kernel offload needs OpenSSL 3 built with ktls, ignored\n");
+    }
+#endif
+
+    if (options.tlsVerifyPeer) {
+        int loaded = options.tlsCaFile.empty()
+                   ? SSL_CTX_set_default_verify_paths(mCtx)
+                   : SSL_CTX_load_verify_locations(mCtx, options.tlsCaFile.c_str(), NULL);
+        if (loaded != 1) {
+            rtspErrorf(NULL, "load ca(%s) failed! %s\n", options.tlsCaFile.c_str(), sslErrorString().c_str());
+            return false;
+        }
+        SSL_CTX_set_verify(mCtx, SSL_VERIFY_PEER, NULL);
+    }
+
+    mSsl = SSL_new(mCtx);
+    if (mSsl == NULL || SSL_set_fd(mSsl, mSocket) != 1) {
+        rtspErrorf(NULL, "create tls session failed! %s\n", sslErrorString().c_str());
+        return false;
+    }
+
+    unsigned char addr[sizeof(struct in6_addr)];
+    bool literal = inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1;
+    if (!literal) {
+        SSL_set_tlsext_host_name(mSsl, host);
+    }
+    if (options.tlsVerifyPeer) {
+        X509_VERIFY_PARAM* param = SSL_get0_param(mSsl);
+        if (literal) {
+            X509_VERIFY_PARAM_set1_ip_asc(param, host);
+        } else {
+            X509_VERIFY_PARAM_set1_host(param, host, 0);
+        }
+    }
+
+    while (true) {
+        ERR_clear_error();
+        ret = SSL_connect(mSsl);
+        if (ret == 1) {
+            break;
+        }
+
+        int err = SSL_get_error(mSsl, ret);
+        short events = err == SSL_ERROR_WANT_READ ? POLLIN : (err == SSL_ERROR_WANT_WRITE ? POLLOUT : 0);
+        if (events != 0 && waitSocket(mSocket, events, deadline)) {
+            continue;
+        }
+
+        long verify = SSL_get_verify_result(mSsl);
+        if (verify != X509_V_OK) {
+            rtspErrorf(NULL, "tls handshake with %s:%u failed! certificate: %s\n", host, port,
+                       X509_verify_cert_error_string(verify));
+        } else {
+            rtspErrorf(NULL, "tls handshake with %s:%u failed! %s\n", host, port,
+                       events != 0 ? "timeout" : sslErrorString().c_str());
+        }
+        return false;
+    }
+
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    // After a TLS 1.2 handshake, only application data is expected, so the kernel can handle the connection on its
+    // own and RTSPClient reads and writes plaintext on it directly.  (TLS 1.3 still sends session tickets and key
+    // updates after the handshake, which the kernel hands back as errors.)
+    if (SSL_version(mSsl) == TLS1_2_VERSION
+        && BIO_get_ktls_send(SSL_get_wbio(mSsl)) && BIO_get_ktls_recv(SSL_get_rbio(mSsl))) {
+        SSL_free(mSsl);     // doesn't close or write to the socket
+        mSsl = NULL;
+        SSL_CTX_free(mCtx);
+        mCtx = NULL;
+        mClientSocket = mSocket;
+        mSocket = -1;
+    }
+#endif
+
+    return true;
+}
+
+bool CTlsTransport::startRelay()
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+        rtspErrorf(NULL, "create tls relay socketpair failed! errno(%d)\n", errno);
+        return false;
+    }
+    fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL) | O_NONBLOCK);
+
+    mRelaySocket = pair[1];
+    if (!startThread()) {
+        rtspErrorf(NULL, "start tls relay thread failed!\n");
+        close(pair[0]);
+        close(pair[1]);
+        mRelaySocket = -1;
+        return false;
+    }
+
+    mClientSocket = pair[0];
+    return true;
+}
+
+void CTlsTransport::threadProc()
+{
+    // writing to a closed connection fails with EPIPE, instead of killing the process
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    char buf[16 * 1024];
+    bool open = true;
+    while (open) {
+        struct pollfd fds[2] = { { mSocket, POLLIN, 0 }, { mRelaySocket, POLLIN, 0 } };
+
+        // poll() doesn't see what OpenSSL has already read
+        bool pending = SSL_pending(mSsl) > 0;
+        if (!pending && poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (pending || fds[0].revents != 0) {
+            open = fromServer(buf, sizeof(buf));
+        }
+        if (open && fds[1].revents != 0) {
+            open = toServer(buf, sizeof(buf));
+        }
+    }
+
+    // RTSPClient sees the connection closed, and reconnects
+    shutdown(mRelaySocket, SHUT_RDWR);
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mFinished = true;
+    }
+    mCond.notify_all();
+}
+
+bool CTlsTransport::fromServer(char* buf, size_t size)
+{
+    while (true) {
+        ERR_clear_error();
+        int n = SSL_read(mSsl, buf, (int)size);
+        if (n <= 0) {
+            int err = SSL_get_error(mSsl, n);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+                return true;
+            }
+            if (err != SSL_ERROR_ZERO_RETURN) {
+                // (also when we're closing, or the server closes without "close_notify")
+                rtspInfof(NULL, "tls connection closed! err(%d) %s\n", err, sslErrorString().c_str());
+            }
+            return false;
+        }
+
+        // blocks while RTSPClient's socket buffer is full, which holds the server back through TCP
+        if (!sendAll(mRelaySocket, buf, n) && !mDraining) {
+            return false;
+        }
+    }
+}
+
+bool CTlsTransport::toServer(char* buf, size_t size)
+{
+    ssize_t n = recv(mRelaySocket, buf, size, 0);
+    if (n < 0 && errno == EINTR) {
+        return true;
+    }
+    if (n == 0) {
+        // RTSPClient closed its socket, after its last request; tell the server we're done (without waiting for its
+        // "close_notify" in return)
+        ERR_clear_error();
+        SSL_shutdown(mSsl);
+        return false;
+    }
+    if (n < 0) {
+        return false;
+    }
+
+    for (ssize_t done = 0; done < n; ) {
+        ERR_clear_error();
+        int ret = SSL_write(mSsl, buf + done, (int)(n - done));
+        if (ret > 0) {
+            done += ret;
+            continue;
+        }
+
+        int err = SSL_get_error(mSsl, ret);
+        short events = err == SSL_ERROR_WANT_READ ? POLLIN : (err == SSL_ERROR_WANT_WRITE ? POLLOUT : 0);
+        if (events == 0) {
+            rtspWarnf(NULL, "tls write failed! err(%d) %s\n", err, sslErrorString().c_str());
+            return false;
+        }
+
+        struct pollfd pfd = { mSocket, events, 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#else
+void CTlsTransport::threadProc()
+{
+}
+#endif // LIVE555CLIENT_WITH_RTSPS
+
+
+} // namespace live555client
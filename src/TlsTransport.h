@@ -0,0 +1,77 @@
+#ifndef __APP_RTSP_CLIENT_TLS_TRANSPORT_H__
+#define __APP_RTSP_CLIENT_TLS_TRANSPORT_H__
+
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include "wize/LoopThread.h"
+#include "live555client/Live555Client.h"
+
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+
+namespace live555client {
+
+
+/// rtsps 连接的 TLS 传输: 连接服务端并握手, 交给 RTSPClient 一个已连接的明文 socket
+/// 内核 TLS (kTLS) 收发都可用时直接交出 TCP socket, 加解密在内核里完成, 不经过用户态 (需要 OpenSSL 3 打开 ktls 编译)
+/// 否则通过 socketpair 和转发线程加解密
+class CTlsTransport : public wize::CLoopThread
+{
+public:
+    /// 是否 rtsps:// url
+    static bool isSecureUrl(char const* url);
+
+    /// 把 rtsps://host[:port]/... 转成 live555 能解析的 rtsp://host:port/..., 没有端口时使用默认的 322
+    static std::string plainUrl(char const* url);
+
+    /// 连接并握手, 阻塞直到完成或超时, 失败返回 NULL
+    static CTlsTransport* open(char const* url, RtspStreamOptions const& options);
+
+    /// 停止转发, socketNum() 由 RTSPClient 关闭
+    ~CTlsTransport();
+
+    /// 正常关闭: 把 RTSPClient 已经写入的请求 (如 TEARDOWN) 发完, 再发送 close_notify
+    /// 在 RTSPClient 关闭 socketNum() 之前调用, 最多阻塞 TLS_FINISH_TIMEOUT_MS
+    void finish();
+
+    /// 交给 RTSPClient 的 socket
+    int socketNum() const { return mClientSocket; }
+
+    /// 是否使用内核 TLS
+    bool kernelOffload() const { return mSsl == NULL; }
+
+private:
+    CTlsTransport(CTlsTransport const&);
+    CTlsTransport& operator=(CTlsTransport const&);
+
+    CTlsTransport();
+
+    bool handshake(char const* host, unsigned short port, RtspStreamOptions const& options);
+    bool startRelay();
+
+    void threadProc();
+    bool fromServer(char* buf, size_t size);
+    bool toServer(char* buf, size_t size);
+
+private:
+    SSL_CTX*    mCtx;
+    SSL*        mSsl;           ///< 转发模式下由转发线程使用, 内核 TLS 模式下握手后释放
+    int         mSocket;        ///< 到服务端的 TCP socket, 内核 TLS 模式下就是 mClientSocket
+    int         mRelaySocket;   ///< socketpair 转发线程这一端
+    int         mClientSocket;
+
+    std::atomic<bool>       mDraining;  ///< finish() 之后, 服务端发来的数据直接丢弃
+    std::mutex              mMutex;
+    std::condition_variable mCond;
+    bool                    mFinished;  ///< 转发线程已经退出循环
+};
+
+
+} // namespace live555client
+
+#endif // __APP_RTSP_CLIENT_TLS_TRANSPORT_H__
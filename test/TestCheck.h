@@ -0,0 +1,36 @@
+#ifndef __APP_RTSP_CLIENT_TEST_CHECK_H__
+#define __APP_RTSP_CLIENT_TEST_CHECK_H__
+
+
+#include <stdio.h>
+
+
+// Scaffold shared by the unit tests: CHECK() prints and counts each failed condition, and main()
+// ends with "return testResult();".
+
+
+namespace {
+
+
+int failures = 0;
+
+/// 打印 PASS 或 FAIL, 返回 main() 的退出码
+int testResult()
+{
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}
+
+
+} // namespace
+
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            ++failures; \
+        } \
+    } while (0)
+
+
+#endif // __APP_RTSP_CLIENT_TEST_CHECK_H__
@@ -0,0 +1,241 @@
+#include "stream/EncodeSpecific.h"
+#include "wize/Packet.h"
+#include "FrameFanout.h"
+#include "TestCheck.h"
+
+
+// Unit test of CFrameFanout's subscription filters: everyNth, maxFps, keyFrameOnly, audio,
+// the per-subscriber wanted callback, mayWant(), frames dropped between wanted() and deliver(),
+// and audio frames delivered while a video frame is being assembled.
+//
+// usage: test_frame_fanout
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+
+namespace {
+
+
+using live555client::CFrameFanout;
+using live555client::FrameFilter;
+
+
+stream::CFrame makeFrame(char frametype, uint64_t pts)
+{
+    if (frametype == 'A') {
+        return stream::CFrameFactory::createAudioFrame(0, 0, pts, 0, stream::ENCODE_G711A, 8000, 1, 160);
+    }
+    return stream::CFrameFactory::createVideoFrame(0, 0, false, pts, 0, stream::ENCODE_H264, frametype, 160);
+}
+
+/// 收流线程的调用顺序: 先 wanted(), 要的话组帧再 deliver()
+void feed(CFrameFanout& fanout, char frametype, uint64_t pts)
+{
+    if (fanout.wanted(frametype, pts)) {
+        fanout.deliver(makeFrame(frametype, pts));
+    }
+}
+
+CFrameFanout::StreamCallback counter(int& count)
+{
+    return [&count](stream::CFrame const&) { ++count; };
+}
+
+FrameFilter makeFilter(bool keyFrameOnly, int everyNth, int maxFps)
+{
+    FrameFilter filter;
+    filter.keyFrameOnly = keyFrameOnly;
+    filter.everyNth = everyNth;
+    filter.maxFps = maxFps;
+    return filter;
+}
+
+
+void testEveryNth()
+{
+    CFrameFanout fanout;
+    int count = 0;
+    auto connection = fanout.connect(counter(count), makeFilter(false, 3, 0));
+
+    for (int i = 0; i < 9; ++i) {
+        feed(fanout, i == 0 ? 'I' : 'P', 1000 + i * 40);
+    }
+    CHECK(count == 3);
+
+    // audio doesn't take part in frame sampling
+    count = 0;
+    for (int i = 0; i < 4; ++i) {
+        feed(fanout, 'A', 2000 + i * 20);
+    }
+    CHECK(count == 4);
+}
+
+void testMaxFps()
+{
+    CFrameFanout fanout;
+    int count = 0;
+    auto connection = fanout.connect(counter(count), makeFilter(false, 0, 10));
+
+    // 25 fps for one second, limited to 10 fps: 1000, 1120, 1240, ... 1960
+    for (int i = 0; i < 25; ++i) {
+        feed(fanout, 'P', 1000 + i * 40);
+    }
+    CHECK(count == 9);
+
+    // a pts that goes back (e.g., the server restarted) is always accepted
+    count = 0;
+    feed(fanout, 'P', 500);
+    CHECK(count == 1);
+}
+
+void testKeyFrameOnly()
+{
+    CFrameFanout fanout;
+    int count = 0;
+    auto connection = fanout.connect(counter(count), makeFilter(true, 0, 0));
+
+    char const frametypes[] = { 'I', 'P', 'P', 'A', 'I', 'P' };
+    for (size_t i = 0; i < sizeof(frametypes); ++i) {
+        feed(fanout, frametypes[i], 1000 + i * 40);
+    }
+    CHECK(count == 2);
+}
+
+void testSubscribersFilteredSeparately()
+{
+    CFrameFanout fanout;
+    int all = 0, keyFrames = 0, plain = 0;
+    auto connection1 = fanout.connect(counter(all), FrameFilter());
+    auto connection2 = fanout.connect(counter(keyFrames), makeFilter(true, 0, 0));
+
+    feed(fanout, 'I', 1000);
+    feed(fanout, 'P', 1040);
+    CHECK(all == 2);
+    CHECK(keyFrames == 1);
+
+    // without filter, a subscriber gets every frame
+    auto connection3 = fanout.connect(counter(plain));
+    feed(fanout, 'P', 1080);
+    CHECK(plain == 1);
+    CHECK(keyFrames == 1);
+}
+
+void testWantedCallback()
+{
+    CFrameFanout fanout;
+    int count = 0;
+    bool want = false;
+    auto connection = fanout.connect(counter(count), makeFilter(false, 2, 0),
+                                     [&want](char, uint64_t) { return want; });
+
+    // nothing wanted: no frame is assembled, and the everyNth counter doesn't move
+    CHECK(!fanout.wanted('I', 1000));
+    feed(fanout, 'P', 1040);
+    CHECK(count == 0);
+
+    want = true;
+    feed(fanout, 'P', 1080);
+    feed(fanout, 'P', 1120);
+    feed(fanout, 'P', 1160);
+    CHECK(count == 2);
+}
+
+void testDroppedFrames()
+{
+    // a frame that is wanted but then dropped (e.g. lost packets) doesn't take the sampling slot
+    CFrameFanout fanout;
+    int count = 0;
+    auto connection = fanout.connect(counter(count), makeFilter(false, 3, 0));
+
+    CHECK(fanout.wanted('I', 1000));
+    CHECK(fanout.wanted('P', 1040));
+    feed(fanout, 'P', 1080);
+    CHECK(count == 1);
+    feed(fanout, 'P', 1120);
+    feed(fanout, 'P', 1160);
+    CHECK(count == 1);
+    feed(fanout, 'P', 1200);
+    CHECK(count == 2);
+
+    // nor the maxFps interval
+    CFrameFanout limited;
+    int limitedCount = 0;
+    auto limitedConnection = limited.connect(counter(limitedCount), makeFilter(false, 0, 10));
+    feed(limited, 'P', 1000);
+    CHECK(limited.wanted('P', 1100));
+    feed(limited, 'P', 1140);
+    CHECK(limitedCount == 2);
+}
+
+void testAudioDuringVideo()
+{
+    // an audio frame between the wanted() and deliver() of a video frame (assembled from several nal units)
+    CFrameFanout fanout;
+    int count = 0, keyFrames = 0;
+    auto connection1 = fanout.connect(counter(count), makeFilter(false, 2, 0));
+    auto connection2 = fanout.connect(counter(keyFrames), makeFilter(true, 0, 0));
+
+    CHECK(fanout.wanted('I', 1000));
+    feed(fanout, 'A', 1010);
+    CHECK(count == 1);
+    CHECK(keyFrames == 0);
+    fanout.deliver(makeFrame('I', 1000));
+    CHECK(count == 2);
+    CHECK(keyFrames == 1);
+
+    // and the skipped video frame after it stays skipped
+    CHECK(!fanout.wanted('P', 1040));
+    feed(fanout, 'A', 1050);
+    fanout.deliver(makeFrame('P', 1040));
+    CHECK(count == 3);
+    CHECK(keyFrames == 1);
+}
+
+void testMayWant()
+{
+    CFrameFanout fanout;
+    int count = 0;
+    CHECK(!fanout.mayWant('I'));
+    CHECK(fanout.empty());
+
+    {
+        auto connection = fanout.connect(counter(count), makeFilter(true, 0, 0));
+        CHECK(fanout.mayWant('I'));
+        CHECK(!fanout.mayWant('P'));
+        CHECK(!fanout.mayWant('A'));
+        CHECK(!fanout.empty());
+
+        // mayWant() doesn't consume the sampling state
+        CHECK(fanout.mayWant('I'));
+        connection.disconnect();
+    }
+    CHECK(!fanout.mayWant('I'));
+    CHECK(fanout.empty());
+
+    auto connection = fanout.connect(counter(count));
+    CHECK(fanout.mayWant('P'));
+}
+
+
+} // namespace
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char *argv[])
+{
+    wize::CPacketFactory::instance()->addPool<4*1024>();
+
+    testEveryNth();
+    testMaxFps();
+    testKeyFrameOnly();
+    testSubscribersFilteredSeparately();
+    testWantedCallback();
+    testDroppedFrames();
+    testAudioDuringVideo();
+    testMayWant();
+
+    return testResult();
+}
@@ -0,0 +1,201 @@
+#include <string.h>
+#include "MediaHelpers.h"
+#include "TestCheck.h"
+
+
+// Unit test of the live555-independent helpers used while assembling frames.
+//
+// usage: test_media_helpers
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+
+namespace {
+
+
+using namespace live555client;
+
+
+void testParameterSets()
+{
+    uint8_t const sps[] = { 0x67, 0x42, 0x00, 0x1f };
+    uint8_t const sps2[] = { 0x67, 0x4d, 0x00, 0x28, 0x95 };
+    uint8_t const pps[] = { 0x68, 0xce, 0x3c, 0x80 };
+    uint8_t const sei[] = { 0x06, 0x05, 0x01 };
+    uint8_t const idr[] = { 0x65, 0x88, 0x84 };
+    uint8_t out[64];
+
+    CH264ParameterSets sets;
+    CHECK(sets.size() == 0);
+    CHECK(!sets.store(idr, sizeof(idr)));
+    CHECK(sets.store(sps, sizeof(sps)));
+    CHECK(sets.store(pps, sizeof(pps)));
+    CHECK(sets.size() == 4 + sizeof(sps) + 4 + sizeof(pps));
+
+    // an IDR that nobody wants doesn't take them, a newer sps replaces the old one
+    CHECK(sets.store(sps2, sizeof(sps2)));
+    CHECK(sets.store(sei, sizeof(sei)));
+
+    uint8_t const expected[] = {
+        0x00, 0x00, 0x00, 0x01, 0x67, 0x4d, 0x00, 0x28, 0x95,
+        0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x3c, 0x80,
+        0x00, 0x00, 0x00, 0x01, 0x06, 0x05, 0x01,
+    };
+    CHECK(sets.size() == sizeof(expected));
+    CHECK(sets.take(out) == sizeof(expected));
+    CHECK(memcmp(out, expected, sizeof(expected)) == 0);
+
+    // the next I frame without new parameter sets gets none
+    CHECK(sets.size() == 0);
+    CHECK(sets.take(out) == 0);
+}
+
+void testLossGate()
+{
+    CLossGate gate;
+
+    // without dropCorrupt, every frame goes out
+    CHECK(gate.pass('P', true, false));
+    CHECK(gate.pass('P', false, false));
+    gate.lost(false);
+    CHECK(!gate.waitingKeyFrame());
+
+    // a loss drops that frame and everything after it, until the next I frame
+    CHECK(gate.pass('I', false, true));
+    CHECK(gate.pass('P', false, true));
+    CHECK(!gate.pass('P', true, true));
+    CHECK(gate.waitingKeyFrame());
+    CHECK(!gate.pass('P', false, true));
+    CHECK(gate.pass('I', false, true));
+    CHECK(gate.pass('P', false, true));
+
+    // an I frame that sees a loss is still whole, and it ends the wait
+    CHECK(!gate.pass('P', true, true));
+    CHECK(gate.pass('I', true, true));
+    CHECK(!gate.waitingKeyFrame());
+
+    // a loss before a parameter set, or another nal that isn't a frame, waits too
+    gate.lost(true);
+    CHECK(!gate.pass('P', false, true));
+    CHECK(gate.pass('I', false, true));
+}
+
+
+void testKeyFrameRequest()
+{
+    uint8_t packet[KEY_FRAME_REQUEST_MAX_SIZE];
+
+    // RR (sender 0x11223344, no report blocks) + PLI for media 0xaabbccdd
+    uint8_t const pli[] = {
+        0x80, 201, 0x00, 0x01, 0x11, 0x22, 0x33, 0x44,
+        0x81, 206, 0x00, 0x02, 0x11, 0x22, 0x33, 0x44, 0xaa, 0xbb, 0xcc, 0xdd,
+    };
+    memset(packet, 0xee, sizeof(packet));
+    CHECK(buildKeyFrameRequest(packet, 0x11223344, 0xaabbccdd, false, 7) == sizeof(pli));
+    CHECK(memcmp(packet, pli, sizeof(pli)) == 0);
+
+    // RR + FIR: media source 0, the SSRC and the command sequence number in the FCI
+    uint8_t const fir[] = {
+        0x80, 201, 0x00, 0x01, 0x11, 0x22, 0x33, 0x44,
+        0x84, 206, 0x00, 0x04, 0x11, 0x22, 0x33, 0x44, 0x00, 0x00, 0x00, 0x00,
+        0xaa, 0xbb, 0xcc, 0xdd, 0x07, 0x00, 0x00, 0x00,
+    };
+    memset(packet, 0xee, sizeof(packet));
+    CHECK(buildKeyFrameRequest(packet, 0x11223344, 0xaabbccdd, true, 7) == sizeof(fir));
+    CHECK(sizeof(fir) == KEY_FRAME_REQUEST_MAX_SIZE);
+    CHECK(memcmp(packet, fir, sizeof(fir)) == 0);
+
+    // each RTCP length field counts 32-bit words minus one
+    CHECK((packet[2] << 8 | packet[3]) == 8 / 4 - 1);
+    CHECK((packet[10] << 8 | packet[11]) == (sizeof(fir) - 8) / 4 - 1);
+}
+
+
+void testAacConfig()
+{
+    CHECK(aacFrequencyIndex(48000) == 3);
+    CHECK(aacFrequencyIndex(44100) == 4);
+    CHECK(aacFrequencyIndex(8000) == 11);
+    CHECK(aacFrequencyIndex(7350) == 12);
+    CHECK(aacFrequencyIndex(90000) == 15);
+
+    // "config=1210": AAC LC, 44.1 kHz, stereo
+    uint8_t const lc[] = { 0x12, 0x10 };
+    AacConfig config;
+    CHECK(parseAacConfig(lc, sizeof(lc), config));
+    CHECK(config.profile == 1);
+    CHECK(config.frequencyIndex == 4);
+    CHECK(config.channelConfig == 2);
+
+    // "config=1408": AAC LC, 16 kHz, mono
+    uint8_t const mono[] = { 0x14, 0x08 };
+    CHECK(parseAacConfig(mono, sizeof(mono), config));
+    CHECK(config.profile == 1);
+    CHECK(config.frequencyIndex == 8);
+    CHECK(config.channelConfig == 1);
+
+    // HE-AAC (object type 5) can't be put in ADTS, an explicit frequency (index 15) or channel config 0 keep
+    // what came from the SDP
+    uint8_t const he[] = { 0x2f, 0x80, 0x00, 0x00, 0x00 };
+    AacConfig sdp;
+    sdp.frequencyIndex = 3;
+    sdp.channelConfig = 2;
+    CHECK(parseAacConfig(he, sizeof(he), sdp));
+    CHECK(sdp.profile == 1);
+    CHECK(sdp.frequencyIndex == 3);
+    CHECK(sdp.channelConfig == 2);
+
+    CHECK(!parseAacConfig(lc, 1, sdp));
+    CHECK(!parseAacConfig(NULL, 0, sdp));
+}
+
+void testAdtsHeader()
+{
+    AacConfig config;
+    config.profile = 1;
+    config.frequencyIndex = 4;
+    config.channelConfig = 2;
+
+    // 371 bytes of AAC: frame length 378 = 0x17a
+    uint8_t header[ADTS_HEADER_SIZE];
+    CHECK(buildAdtsHeader(header, config, 371));
+    uint8_t const expected[] = { 0xff, 0xf1, 0x50, 0x80, 0x2f, 0x5f, 0xfc };
+    CHECK(memcmp(header, expected, sizeof(expected)) == 0);
+
+    // parse it back the way a decoder does
+    unsigned length = ((header[3] & 0x03) << 11) | (header[4] << 3) | (header[5] >> 5);
+    CHECK(length == ADTS_HEADER_SIZE + 371);
+    CHECK((header[2] >> 6) == config.profile);
+    CHECK(((header[2] >> 2) & 0x0f) == config.frequencyIndex);
+    CHECK((((header[2] & 0x01) << 2) | (header[3] >> 6)) == config.channelConfig);
+    CHECK((header[1] & 0x01) == 1); // no CRC
+
+    // the largest frame ADTS can describe, 13 bits of length, and a channel config with its high bit set
+    config.channelConfig = 7;
+    CHECK(buildAdtsHeader(header, config, ADTS_MAX_FRAME_SIZE - ADTS_HEADER_SIZE));
+    length = ((header[3] & 0x03) << 11) | (header[4] << 3) | (header[5] >> 5);
+    CHECK(length == 8191);
+    CHECK((((header[2] & 0x01) << 2) | (header[3] >> 6)) == 7);
+
+    // one byte more doesn't fit in the length field
+    CHECK(!buildAdtsHeader(header, config, ADTS_MAX_FRAME_SIZE - ADTS_HEADER_SIZE + 1));
+}
+
+
+} // namespace
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char *argv[])
+{
+    testParameterSets();
+    testLossGate();
+    testKeyFrameRequest();
+    testAacConfig();
+    testAdtsHeader();
+
+    return testResult();
+}
@@ -0,0 +1,751 @@
+
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#if LIVE555CLIENT_WITH_RTSPS
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+#include "wize/Log.h"
+#include "wize/Component.h"
+#include "wize/Packet.h"
+#include "live555client/Live555Client.h"
+
+
+// Lifecycle churn benchmark: creates, starts, stops and destroys rtsp sources against a local fake
+// server that randomly drops connections. Some sources are kept long enough to see drops and
+// reconnects, some share a stream or a connection with other workers, and some start and stop a
+// sibling stream on their shared connection from the frame callback. Reports ops/s, stop latency
+// percentiles, fd and RSS growth, exits non-zero on leaks, and aborts when a stop or destroy hangs.
+// With tls=1 the server speaks rtsps, with a self-signed certificate that the client verifies (only
+// when live555client is built with LIVE555CLIENT_WITH_RTSPS, the fake server needs OpenSSL then).
+//
+// usage: test_rtsp_churn [iterations=2000] [workers=8] [dropPercent=30] [tls=0]
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+
+namespace {
+
+
+uint64_t nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int countFds()
+{
+    int count = 0;
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return -1;
+    }
+    while (readdir(dir) != NULL) {
+        ++count;
+    }
+    closedir(dir);
+    return count - 3;   // ".", ".." and the dir itself
+}
+
+long rssKb()
+{
+    long pages = 0, resident = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+        resident = -1;
+    }
+    fclose(fp);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+/// 假服务端的一条连接, ssl 不为 NULL 时是 rtsps
+struct Peer
+{
+    int     fd;
+#if LIVE555CLIENT_WITH_RTSPS
+    SSL*    ssl;
+#endif
+
+    explicit Peer(int s)
+        : fd(s)
+#if LIVE555CLIENT_WITH_RTSPS
+        , ssl(NULL)
+#endif
+    {
+    }
+
+    ssize_t write(char const* data, size_t size) const
+    {
+#if LIVE555CLIENT_WITH_RTSPS
+        if (ssl != NULL) {
+            return SSL_write(ssl, data, (int)size);
+        }
+#endif
+        return send(fd, data, size, MSG_NOSIGNAL);
+    }
+
+    ssize_t read(char* buf, size_t size)
+    {
+#if LIVE555CLIENT_WITH_RTSPS
+        if (ssl != NULL) {
+            return SSL_read(ssl, buf, (int)size);
+        }
+#endif
+        return recv(fd, buf, size, 0);
+    }
+
+    /// OpenSSL 已经读进来但还没取走的数据, poll() 看不到
+    bool pending() const
+    {
+#if LIVE555CLIENT_WITH_RTSPS
+        return ssl != NULL && SSL_pending(ssl) > 0;
+#else
+        return false;
+#endif
+    }
+
+    void close()
+    {
+#if LIVE555CLIENT_WITH_RTSPS
+        if (ssl != NULL) {
+            SSL_free(ssl);
+            ssl = NULL;
+        }
+#endif
+        ::close(fd);
+    }
+};
+
+
+/// 本地假 rtsp 服务端: 只支持 RTP over TCP, 每 40ms 发一个 H264 单 nal 包, 按比例随机断开连接
+class CFakeRtspServer
+{
+public:
+    CFakeRtspServer(int dropPercent, bool tls)
+        : mFd(-1), mPort(0), mDropPercent(dropPercent), mCtx(NULL), mStopping(false), mSessions(0)
+    {
+#if LIVE555CLIENT_WITH_RTSPS
+        if (tls) {
+            mCtx = SSL_CTX_new(TLS_server_method());
+        }
+#endif
+    }
+
+    ~CFakeRtspServer()
+    {
+        stop();
+#if LIVE555CLIENT_WITH_RTSPS
+        if (mCtx != NULL) {
+            SSL_CTX_free(mCtx);
+        }
+#endif
+    }
+
+    /// rtsps 时生成 127.0.0.1 的自签名证书, 写到 caFile 给客户端校验
+    bool start(char const* caFile)
+    {
+#if LIVE555CLIENT_WITH_RTSPS
+        if (mCtx != NULL && !makeCertificate(caFile)) {
+            return false;
+        }
+#endif
+
+        mFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (mFd < 0) {
+            return false;
+        }
+
+        int on = 1;
+        setsockopt(mFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        socklen_t len = sizeof(addr);
+        if (bind(mFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(mFd, 256) != 0
+            || getsockname(mFd, (struct sockaddr*)&addr, &len) != 0) {
+            close(mFd);
+            mFd = -1;
+            return false;
+        }
+
+        mPort = ntohs(addr.sin_port);
+        mThread = std::thread(&CFakeRtspServer::acceptLoop, this);
+        return true;
+    }
+
+    void stop()
+    {
+        if (mFd < 0) {
+            return;
+        }
+
+        mStopping = true;
+        mThread.join();
+        close(mFd);
+        mFd = -1;
+
+        // sessions see mStopping within one poll interval
+        while (mSessions > 0) {
+            usleep(10 * 1000);
+        }
+    }
+
+    int port() const { return mPort; }
+
+    int sessions() const { return mSessions; }
+
+private:
+#if LIVE555CLIENT_WITH_RTSPS
+    bool makeCertificate(char const* caFile)
+    {
+        // (EVP_RSA_gen() is OpenSSL 3 only)
+        EVP_PKEY* key = NULL;
+        EVP_PKEY_CTX* keyCtx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+        if (keyCtx == NULL || EVP_PKEY_keygen_init(keyCtx) <= 0
+            || EVP_PKEY_CTX_set_rsa_keygen_bits(keyCtx, 2048) <= 0 || EVP_PKEY_keygen(keyCtx, &key) <= 0) {
+            key = NULL;
+        }
+        EVP_PKEY_CTX_free(keyCtx);
+        X509* cert = X509_new();
+        bool ok = key != NULL && cert != NULL;
+        if (ok) {
+            ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+            X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+            X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+            X509_set_pubkey(cert, key);
+            X509_NAME* name = X509_get_subject_name(cert);
+            X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char const*)"127.0.0.1", -1, -1, 0);
+            X509_set_issuer_name(cert, name);
+            X509_EXTENSION* san = X509V3_EXT_conf_nid(NULL, NULL, NID_subject_alt_name, (char*)"IP:127.0.0.1");
+            ok = san != NULL && X509_add_ext(cert, san, -1) == 1 && X509_sign(cert, key, EVP_sha256()) > 0
+                && SSL_CTX_use_certificate(mCtx, cert) == 1 && SSL_CTX_use_PrivateKey(mCtx, key) == 1;
+            X509_EXTENSION_free(san);
+        }
+
+        FILE* fp = ok ? fopen(caFile, "w") : NULL;
+        ok = fp != NULL && PEM_write_X509(fp, cert) == 1;
+        if (fp != NULL) {
+            fclose(fp);
+        }
+
+        X509_free(cert);
+        EVP_PKEY_free(key);
+        return ok;
+    }
+#endif
+
+    void acceptLoop()
+    {
+        while (!mStopping) {
+            struct pollfd pfd = { mFd, POLLIN, 0 };
+            if (poll(&pfd, 1, 50) <= 0) {
+                continue;
+            }
+
+            int fd = accept(mFd, NULL, NULL);
+            if (fd < 0) {
+                continue;
+            }
+
+            ++mSessions;
+            std::thread(&CFakeRtspServer::session, this, fd).detach();
+        }
+    }
+
+    static std::string header(std::string const& request, char const* name)
+    {
+        auto pos = request.find(name);
+        if (pos == std::string::npos) {
+            return std::string();
+        }
+        pos += strlen(name);
+        while (pos < request.size() && request[pos] == ' ') {
+            ++pos;
+        }
+        auto end = request.find("\r\n", pos);
+        return request.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+    }
+
+    static bool sendAll(Peer const& peer, char const* data, size_t size)
+    {
+        while (size > 0) {
+            ssize_t n = peer.write(data, size);
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    /// 处理一个请求, 返回 false 表示关闭连接
+    bool handleRequest(Peer const& peer, std::string const& request, bool& playing, int& channel)
+    {
+        auto method = request.substr(0, request.find(' '));
+        auto url = request.substr(method.size() + 1, request.find(' ', method.size() + 1) - method.size() - 1);
+        auto cseq = header(request, "CSeq:");
+
+        std::string extra;
+        std::string body;
+        if (method == "OPTIONS") {
+            extra = "Public: OPTIONS, DESCRIBE, SETUP, TEARDOWN, PLAY, GET_PARAMETER\r\n";
+        } else if (method == "DESCRIBE") {
+            body = "v=0\r\n"
+                   "o=- 0 0 IN IP4 127.0.0.1\r\n"
+                   "s=churn\r\n"
+                   "t=0 0\r\n"
+                   "m=video 0 RTP/AVP 96\r\n"
+                   "c=IN IP4 0.0.0.0\r\n"
+                   "a=rtpmap:96 H264/90000\r\n"
+                   "a=control:track1\r\n";
+            extra = "Content-Base: " + url + "/\r\nContent-Type: application/sdp\r\n";
+        } else if (method == "SETUP") {
+            auto transport = header(request, "Transport:");
+            auto pos = transport.find("interleaved=");
+            if (pos == std::string::npos) {
+                // udp is not supported
+                std::string reply = "RTSP/1.0 461 Unsupported Transport\r\nCSeq: " + cseq + "\r\n\r\n";
+                return sendAll(peer, reply.data(), reply.size());
+            }
+            channel = atoi(transport.c_str() + pos + 12);
+            char buf[128];
+            snprintf(buf, sizeof(buf), "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d\r\nSession: 12345678;timeout=60\r\n",
+                     channel, channel + 1);
+            extra = buf;
+        } else if (method == "PLAY") {
+            extra = "Session: 12345678\r\nRange: npt=0.000-\r\n";
+            playing = true;
+        } else if (method == "TEARDOWN") {
+            std::string reply = "RTSP/1.0 200 OK\r\nCSeq: " + cseq + "\r\n\r\n";
+            sendAll(peer, reply.data(), reply.size());
+            return false;
+        }
+
+        char length[64];
+        snprintf(length, sizeof(length), "Content-Length: %u\r\n", (unsigned)body.size());
+        std::string reply = "RTSP/1.0 200 OK\r\nCSeq: " + cseq + "\r\n" + extra + length + "\r\n" + body;
+        return sendAll(peer, reply.data(), reply.size());
+    }
+
+    bool sendRtp(Peer const& peer, int channel, uint16_t seq, uint32_t timestamp)
+    {
+        uint8_t packet[4 + 12 + 1 + 200];
+        size_t size = 12 + 1 + 200;
+        packet[0] = '$';
+        packet[1] = (uint8_t)channel;
+        packet[2] = (uint8_t)(size >> 8);
+        packet[3] = (uint8_t)size;
+
+        uint8_t* rtp = packet + 4;
+        rtp[0] = 0x80;
+        rtp[1] = 0x80 | 96;     // marker, H264
+        rtp[2] = seq >> 8;
+        rtp[3] = seq;
+        rtp[4] = timestamp >> 24;
+        rtp[5] = timestamp >> 16;
+        rtp[6] = timestamp >> 8;
+        rtp[7] = timestamp;
+        rtp[8] = 0x12;
+        rtp[9] = 0x34;
+        rtp[10] = 0x56;
+        rtp[11] = 0x78;
+        rtp[12] = (seq % 25 == 0) ? 0x65 : 0x41;   // IDR every 25 frames, otherwise P slice
+        memset(rtp + 13, 0xab, 200);
+
+        return sendAll(peer, (char const*)packet, 4 + size);
+    }
+
+    void session(int fd)
+    {
+        std::mt19937 random((unsigned)(nowMs() ^ (uint64_t)fd));
+        bool drop = (int)(random() % 100) < mDropPercent;
+        uint64_t dropAt = nowMs() + random() % 300;
+
+        std::string buffer;
+        bool playing = false;
+        int channel = 0;
+        uint16_t seq = 0;
+        uint64_t nextFrame = nowMs();
+
+        Peer peer(fd);
+#if LIVE555CLIENT_WITH_RTSPS
+        if (mCtx != NULL) {
+            // SSL_read() blocks until a whole record is in
+            struct timeval timeout = { 2, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            peer.ssl = SSL_new(mCtx);
+            SSL_set_fd(peer.ssl, fd);
+            if (SSL_accept(peer.ssl) != 1) {
+                // the client went away during the handshake
+                peer.close();
+                --mSessions;
+                return;
+            }
+        }
+#endif
+
+        while (!mStopping) {
+            if (drop && nowMs() >= dropAt) {
+                // abrupt close, as a flapping camera would do
+                struct linger lg = { 1, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                break;
+            }
+
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            int ret = peer.pending() ? 1 : poll(&pfd, 1, 10);
+            if (ret < 0 && errno != EINTR) {
+                break;
+            }
+
+            if (ret > 0) {
+                char buf[4096];
+                ssize_t n = peer.read(buf, sizeof(buf));
+                if (n <= 0) {
+                    break;
+                }
+                buffer.append(buf, n);
+            }
+
+            bool open = true;
+            while (open && !buffer.empty()) {
+                if (buffer[0] == '$') {
+                    // interleaved RTCP from the client
+                    if (buffer.size() < 4) {
+                        break;
+                    }
+                    size_t len = 4 + (((uint8_t)buffer[2] << 8) | (uint8_t)buffer[3]);
+                    if (buffer.size() < len) {
+                        break;
+                    }
+                    buffer.erase(0, len);
+                    continue;
+                }
+
+                auto end = buffer.find("\r\n\r\n");
+                if (end == std::string::npos) {
+                    break;
+                }
+                std::string request = buffer.substr(0, end + 4);
+                buffer.erase(0, end + 4);
+                open = handleRequest(peer, request, playing, channel);
+            }
+            if (!open) {
+                break;
+            }
+
+            if (playing && nowMs() >= nextFrame) {
+                nextFrame += 40;
+                ++seq;
+                if (!sendRtp(peer, channel, seq, seq * 3600)) {
+                    break;
+                }
+            }
+        }
+
+        peer.close();
+        --mSessions;
+    }
+
+private:
+    int                 mFd;
+    int                 mPort;
+    int                 mDropPercent;
+#if LIVE555CLIENT_WITH_RTSPS
+    SSL_CTX*            mCtx;       ///< rtsps 时不为 NULL
+#else
+    void*               mCtx;       ///< 总是 NULL
+#endif
+    std::atomic<bool>   mStopping;
+    std::atomic<int>    mSessions;
+    std::thread         mThread;
+};
+
+
+/// 在流回调里开启和停止同一条共用连接上的另一路流, 同时别的 worker 在这条连接上开启停止它们自己的流
+/// 还有一路按需收流, 回调里订阅和取消订阅, 由空闲检查线程关闭 (它要等收流线程同步)
+struct Sibling
+{
+    stream::IStreamSourcePtr    source;
+    stream::IStreamSourcePtr    onDemand;
+    stream::IStreamSource::Connection subscription;
+    int                         frames;
+    bool                        started;
+
+    Sibling() : frames(0), started(false) {}
+
+    /// 在收流线程里调用
+    void onFrame()
+    {
+        ++frames;
+        if (frames % 4 == 1 && !started) {
+            source->start();
+            started = true;
+        } else if (frames % 4 == 3 && started) {
+            source->stop();
+            started = false;
+        }
+
+        if (frames % 6 == 1) {
+            subscription = onDemand->connect([](stream::CFrame const&) {});
+        } else if (frames % 6 == 4) {
+            subscription.disconnect();
+        }
+    }
+};
+
+
+/// 每个 worker 正在进行的 stop() 和销毁的开始时间, 0 表示没有
+std::vector<std::atomic<uint64_t> >* gStopStarted = NULL;
+
+uint64_t const HANG_MS = 15000;
+
+void watchdog(std::atomic<bool>* done)
+{
+    while (!*done) {
+        usleep(100 * 1000);
+        uint64_t now = nowMs();
+        for (size_t i = 0; i < gStopStarted->size(); ++i) {
+            uint64_t started = (*gStopStarted)[i];
+            if (started != 0 && now - started > HANG_MS) {
+                printf("FAIL: worker %u stop()/destroy hangs for %llu ms\n", (unsigned)i, (unsigned long long)(now - started));
+                fflush(stdout);
+                _exit(2);
+            }
+        }
+    }
+}
+
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    int workers = argc > 2 ? atoi(argv[2]) : 8;
+    int dropPercent = argc > 3 ? atoi(argv[3]) : 30;
+    bool tls = argc > 4 && atoi(argv[4]) != 0;
+
+#if !LIVE555CLIENT_WITH_RTSPS
+    if (tls) {
+        printf("SKIP: live555client is built without rtsps\n");
+        return 0;
+    }
+#endif
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // init packet pool
+    wize::CPacketFactory::instance()->addPool<4*1024>();
+    wize::CPacketFactory::instance()->addPool<8*1024>();
+    wize::CPacketFactory::instance()->addPool<16*1024>();
+    wize::CPacketFactory::instance()->addPool<32*1024>();
+    wize::CPacketFactory::instance()->addPool<64*1024>();
+    wize::CPacketFactory::instance()->addPool<128*1024>();
+
+    char caFile[64];
+    snprintf(caFile, sizeof(caFile), "/tmp/test_rtsp_churn_%d.pem", (int)getpid());
+    CFakeRtspServer server(dropPercent, tls);
+    if (!server.start(caFile)) {
+        printf("FAIL: start fake rtsp server: %s\n", strerror(errno));
+        return 1;
+    }
+
+    std::vector<std::atomic<uint64_t> > stopStarted(workers);
+    for (auto& started : stopStarted) {
+        started = 0;
+    }
+    gStopStarted = &stopStarted;
+    std::atomic<bool> done(false);
+    std::thread dog(watchdog, &done);
+
+    std::atomic<int> next(0);
+    std::atomic<int> last(0);
+    std::atomic<uint64_t> frames(0);
+    std::atomic<int> failures(0);
+    std::mutex latencyMutex;
+    std::vector<uint64_t> latencies;
+
+    auto worker = [&](int id) {
+        std::mt19937 random(id * 7919 + next);
+        while (true) {
+            int i = next++;
+            if (i >= last) {
+                break;
+            }
+
+            // every third source shares its stream with other workers, every other one its connection
+            char url[128];
+            if (i % 3 == 0) {
+                snprintf(url, sizeof(url), "%s://127.0.0.1:%d/churn/shared/%d", tls ? "rtsps" : "rtsp", server.port(), i % 8);
+            } else {
+                snprintf(url, sizeof(url), "%s://127.0.0.1:%d/churn/%d", tls ? "rtsps" : "rtsp", server.port(), i);
+            }
+            live555client::RtspStreamOptions options;
+            options.streamUsingTcp = true;
+            options.shareConnection = i % 2 == 0;
+            options.shareStream = i % 3 == 0;
+            options.noFrameTimeoutMs = 1000;
+            options.reconnectDelayMs = 50;  // so that reconnects happen while the source is alive
+            options.tlsCaFile = caFile;
+
+            auto source = live555client::createRtspStream(url, NULL, NULL, options);
+            if (!source) {
+                ++failures;
+                continue;
+            }
+
+            // every eighth source (all on the shared connection) starts and stops a sibling from its callback
+            std::shared_ptr<Sibling> sibling;
+            if (i % 8 == 4) {
+                char siblingUrl[128];
+                snprintf(siblingUrl, sizeof(siblingUrl), "%s://127.0.0.1:%d/churn/sibling/%d", tls ? "rtsps" : "rtsp",
+                         server.port(), i);
+                sibling.reset(new Sibling());
+                sibling->source = live555client::createRtspStream(siblingUrl, NULL, NULL, options);
+
+                auto onDemandOptions = options;
+                onDemandOptions.onDemand = true;
+                onDemandOptions.idleTimeoutMs = 100;
+                strcat(siblingUrl, "/ondemand");
+                sibling->onDemand = live555client::createRtspStream(siblingUrl, NULL, NULL, onDemandOptions);
+                if (!sibling->source || !sibling->onDemand) {
+                    ++failures;
+                    sibling.reset();
+                } else {
+                    sibling->onDemand->start();
+                }
+            }
+
+            auto connection = source->connect([&frames, sibling](stream::CFrame const&) {
+                ++frames;
+                if (sibling) {
+                    sibling->onFrame();
+                }
+            });
+            source->start();
+            // every fourth source lives through the server's drops (within 300 ms) and the reconnects
+            usleep((i % 4 == 0 ? 400 + random() % 300 : random() % 100) * 1000);
+
+            uint64_t begin = nowMs();
+            stopStarted[id] = begin;
+            source->stop();
+            uint64_t latency = nowMs() - begin;
+
+            // (no more callbacks of the source now, so the sibling is ours)
+            if (sibling) {
+                sibling->source->stop();
+                sibling->onDemand->stop();
+                sibling->subscription.disconnect();
+            }
+
+            connection.disconnect();
+            source.reset();
+            sibling.reset();
+            stopStarted[id] = 0;
+
+            std::lock_guard<std::mutex> lock(latencyMutex);
+            latencies.push_back(latency);
+        }
+    };
+
+    auto run = [&](int count) {
+        last = next + count;
+        std::vector<std::thread> threads;
+        for (int id = 0; id < workers; ++id) {
+            threads.push_back(std::thread(worker, id));
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        // the server closes its side when it sees the client's close
+        for (int retry = 0; retry < 50 && server.sessions() > 0; ++retry) {
+            usleep(100 * 1000);
+        }
+    };
+
+    // warm up (log queues, packet pools, lazily started threads) before taking the baseline
+    run(std::max(iterations / 10, workers));
+    latencies.clear();
+    int fdsBefore = countFds();
+    long rssBefore = rssKb();
+
+    uint64_t begin = nowMs();
+    run(iterations);
+    uint64_t elapsed = std::max<uint64_t>(nowMs() - begin, 1);
+    int fdsAfter = countFds();
+    long rssAfter = rssKb();
+
+    done = true;
+    dog.join();
+    server.stop();
+    if (tls) {
+        unlink(caFile);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) -> unsigned long long {
+        if (latencies.empty()) {
+            return 0;
+        }
+        size_t index = std::min(latencies.size() - 1, (size_t)(p * latencies.size()));
+        return latencies[index];
+    };
+
+    printf("iterations %d, workers %d, drop %d%%%s\n", iterations, workers, dropPercent, tls ? ", rtsps" : "");
+    printf("ops/s      %.1f (create+start+stop+destroy)\n", iterations * 1000.0 / elapsed);
+    printf("frames     %llu\n", (unsigned long long)frames);
+    printf("stop ms    p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+           percentile(0.50), percentile(0.90), percentile(0.99), percentile(1.0));
+    printf("fds        %d -> %d\n", fdsBefore, fdsAfter);
+    printf("rss kB     %ld -> %ld\n", rssBefore, rssAfter);
+
+    int rc = 0;
+    if (failures > 0) {
+        printf("FAIL: %d sources could not be created\n", (int)failures);
+        rc = 1;
+    }
+    if (fdsAfter > fdsBefore) {
+        printf("FAIL: %d fds leaked\n", fdsAfter - fdsBefore);
+        rc = 1;
+    }
+    // allocator caches and pools settle within a few MB; a per-iteration leak grows with iterations
+    if (rssAfter - rssBefore > 16 * 1024) {
+        printf("FAIL: rss grew by %ld kB\n", rssAfter - rssBefore);
+        rc = 1;
+    }
+
+    printf(rc == 0 ? "PASS\n" : "FAILED\n");
+    return rc;
+}
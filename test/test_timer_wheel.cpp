@@ -0,0 +1,320 @@
+#include <memory>
+#include <random>
+#include <vector>
+#include "TimerWheel.h"
+#include "TestCheck.h"
+
+
+// Unit test of CTimerWheel: expiry rounding, cascading through all levels, timers beyond the
+// wheel's range, nextExpiry(), cancel and re-arm, skipping idle ticks, and callbacks that arm,
+// cancel, or destroy the wheel.
+//
+// usage: test_timer_wheel
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+
+namespace {
+
+
+using live555client::CTimerWheel;
+
+
+/// 记录到期时间的定时器
+struct Probe
+{
+    CTimerWheel::Timer  timer;
+    uint64_t*           nowMs;
+    uint64_t            firedMs;
+    int                 fired;
+
+    explicit Probe(uint64_t* now) : nowMs(now), firedMs(0), fired(0) {}
+
+    static void onTimer(void* clientData)
+    {
+        Probe* probe = (Probe*)clientData;
+        probe->firedMs = *probe->nowMs;
+        ++probe->fired;
+    }
+};
+
+
+void testRounding()
+{
+    uint64_t now = 1000;
+    CTimerWheel wheel(10, now);
+    Probe probe(&now);
+
+    // 1025 rounds up to the tick at 1030
+    wheel.armAt(probe.timer, 1025, Probe::onTimer, &probe);
+    CHECK(probe.timer.armed());
+    CHECK(wheel.size() == 1);
+
+    uint64_t next = 0;
+    CHECK(wheel.nextExpiry(next));
+    CHECK(next == 1030);
+
+    wheel.advance(now = 1029);
+    CHECK(probe.fired == 0);
+    wheel.advance(now = 1030);
+    CHECK(probe.fired == 1);
+    CHECK(!probe.timer.armed());
+    CHECK(wheel.size() == 0);
+    CHECK(!wheel.nextExpiry(next));
+
+    // an expiry in the past fires on the next tick
+    wheel.armAt(probe.timer, 500, Probe::onTimer, &probe);
+    wheel.advance(now = 1040);
+    CHECK(probe.fired == 2);
+}
+
+void testCascade()
+{
+    uint64_t now = 0;
+    CTimerWheel wheel(10, now);
+
+    // one timer on each level (64, 64^2, 64^3 ticks), plus some just around the level boundaries
+    uint64_t const delays[] = { 50, 630, 640, 650, 700, 40950, 40960, 50000, 2621430, 2621440, 7200000, 7200005 };
+    size_t const count = sizeof(delays) / sizeof(delays[0]);
+    std::vector<std::unique_ptr<Probe> > probes;
+    for (size_t i = 0; i < count; ++i) {
+        probes.push_back(std::unique_ptr<Probe>(new Probe(&now)));
+        wheel.armAt(probes[i]->timer, now + delays[i], Probe::onTimer, probes[i].get());
+    }
+    CHECK(wheel.size() == count);
+
+    uint64_t next = 0;
+    CHECK(wheel.nextExpiry(next));
+    CHECK(next == 50);
+
+    // advance in steps that don't line up with the ticks
+    while (now < 7300000) {
+        now += 7;
+        wheel.advance(now);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t expected = (delays[i] + 9) / 10 * 10;
+        CHECK(probes[i]->fired == 1);
+        CHECK(probes[i]->firedMs >= expected && probes[i]->firedMs < expected + 7);
+    }
+    CHECK(wheel.size() == 0);
+}
+
+void testBeyondRange()
+{
+    // 64^4 ticks of 1s is about 194 days
+    uint64_t now = 0;
+    CTimerWheel wheel(1000, now);
+    Probe probe(&now);
+
+    uint64_t const expires = 300ull * 24 * 3600 * 1000;
+    wheel.armAt(probe.timer, expires, Probe::onTimer, &probe);
+
+    uint64_t next = 0;
+    CHECK(wheel.nextExpiry(next));
+    CHECK(next == expires);
+
+    while (now < expires - 3600 * 1000) {
+        now += 3600 * 1000;
+        wheel.advance(now);
+    }
+    CHECK(probe.fired == 0);
+
+    wheel.advance(now = expires);
+    CHECK(probe.fired == 1);
+    CHECK(probe.firedMs == expires);
+}
+
+void testCancelAndRearm()
+{
+    uint64_t now = 0;
+    CTimerWheel wheel(10, now);
+    Probe a(&now), b(&now);
+
+    wheel.armAt(a.timer, 100, Probe::onTimer, &a);
+    wheel.armAt(b.timer, 5000, Probe::onTimer, &b);
+    wheel.cancel(a.timer);
+    CHECK(!a.timer.armed());
+    CHECK(wheel.size() == 1);
+    wheel.cancel(a.timer); // not armed: ignored
+    CHECK(wheel.size() == 1);
+
+    // re-arming moves it
+    wheel.armAt(b.timer, 200, Probe::onTimer, &b);
+    CHECK(wheel.size() == 1);
+    uint64_t next = 0;
+    CHECK(wheel.nextExpiry(next));
+    CHECK(next == 200);
+
+    wheel.advance(now = 6000);
+    CHECK(a.fired == 0);
+    CHECK(b.fired == 1);
+    CHECK(b.firedMs == 6000);
+}
+
+void testIdleSkip()
+{
+    uint64_t now = 0;
+    CTimerWheel wheel(10, now);
+    Probe probe(&now);
+
+    // nothing armed: a long idle time is skipped, and the next timer is relative to the new time
+    wheel.advance(now = 10 * 24 * 3600 * 1000ull);
+    wheel.armAt(probe.timer, now + 30, Probe::onTimer, &probe);
+    wheel.advance(now += 20);
+    CHECK(probe.fired == 0);
+    wheel.advance(now += 10);
+    CHECK(probe.fired == 1);
+
+    // time going back is ignored
+    wheel.armAt(probe.timer, now + 30, Probe::onTimer, &probe);
+    wheel.advance(now - 1000);
+    CHECK(probe.fired == 1);
+    CHECK(probe.timer.armed());
+    wheel.cancel(probe.timer);
+}
+
+void testNextExpiryRandom()
+{
+    // the cached earliest expiry, and its lookup by the occupancy bitmaps, against a scan of all armed timers
+    uint64_t now = 0;
+    CTimerWheel wheel(10, now);
+    std::mt19937 random(1234);
+    uint64_t const ranges[] = { 600, 40000, 2600000, 170000000, 200000000 };
+
+    std::vector<std::unique_ptr<Probe> > probes;
+    std::vector<uint64_t> expires;
+    for (int i = 0; i < 200; ++i) {
+        probes.push_back(std::unique_ptr<Probe>(new Probe(&now)));
+        expires.push_back(0);
+    }
+
+    for (int step = 0; step < 20000; ++step) {
+        size_t i = random() % probes.size();
+        switch (random() % 4) {
+        case 0:
+        case 1: {
+            uint64_t delay = 11 + random() % ranges[random() % 5];
+            wheel.armAt(probes[i]->timer, now + delay, Probe::onTimer, probes[i].get());
+            expires[i] = (now + delay + 9) / 10 * 10;
+            break;
+        }
+        case 2:
+            wheel.cancel(probes[i]->timer);
+            break;
+        default:
+            wheel.advance(now += random() % 2000);
+            break;
+        }
+
+        uint64_t expected = UINT64_MAX;
+        for (size_t j = 0; j < probes.size(); ++j) {
+            if (probes[j]->timer.armed() && expires[j] < expected) {
+                expected = expires[j];
+            }
+        }
+
+        uint64_t next = 0;
+        bool armed = wheel.nextExpiry(next);
+        CHECK(armed == (expected != UINT64_MAX));
+        if (armed && next != expected) {
+            CHECK(next == expected);
+            break;
+        }
+    }
+
+    for (auto& probe : probes) {
+        wheel.cancel(probe->timer);
+    }
+}
+
+
+/// 回调里重新启动自己, 取消另一个, 或者析构时间轮
+struct Actor
+{
+    CTimerWheel*        wheel;
+    CTimerWheel::Timer  timer;
+    CTimerWheel::Timer* victim;
+    uint64_t*           nowMs;
+    int                 fired;
+    int                 repeat;
+    bool                destroy;
+
+    Actor(CTimerWheel* w, uint64_t* now) : wheel(w), victim(NULL), nowMs(now), fired(0), repeat(0), destroy(false) {}
+
+    static void onTimer(void* clientData)
+    {
+        Actor* actor = (Actor*)clientData;
+        ++actor->fired;
+        if (actor->victim != NULL) {
+            actor->wheel->cancel(*actor->victim);
+        }
+        if (actor->fired < actor->repeat) {
+            actor->wheel->armAt(actor->timer, *actor->nowMs + 100, onTimer, actor);
+        }
+        if (actor->destroy) {
+            delete actor->wheel;
+            actor->wheel = NULL;
+        }
+    }
+};
+
+void testCallbacks()
+{
+    uint64_t now = 0;
+    CTimerWheel* wheel = new CTimerWheel(10, now);
+
+    // a periodic timer, re-armed from its callback
+    Actor periodic(wheel, &now);
+    periodic.repeat = 5;
+    wheel->armAt(periodic.timer, 100, Actor::onTimer, &periodic);
+
+    // a timer that cancels another one due on the same tick
+    Probe victim(&now);
+    Actor canceller(wheel, &now);
+    canceller.victim = &victim.timer;
+    wheel->armAt(canceller.timer, 50, Actor::onTimer, &canceller);
+    wheel->armAt(victim.timer, 50, Probe::onTimer, &victim);
+
+    for (now = 0; now < 1000; now += 10) {
+        wheel->advance(now);
+    }
+    CHECK(periodic.fired == 5);
+    CHECK(canceller.fired == 1);
+    CHECK(victim.fired == 0);
+    CHECK(wheel->size() == 0);
+
+    // a callback destroys the wheel; the other timer due on that tick doesn't run
+    Actor destroyer(wheel, &now);
+    destroyer.destroy = true;
+    Probe after(&now);
+    wheel->armAt(destroyer.timer, now + 10, Actor::onTimer, &destroyer);
+    wheel->armAt(after.timer, now + 10, Probe::onTimer, &after);
+    wheel->advance(now + 100);
+    CHECK(destroyer.fired == 1);
+    CHECK(destroyer.wheel == NULL);
+    CHECK(after.fired == 0);
+    CHECK(!after.timer.armed());
+}
+
+
+} // namespace
+
+
+////////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char *argv[])
+{
+    testRounding();
+    testCascade();
+    testBeyondRange();
+    testCancelAndRearm();
+    testIdleSkip();
+    testNextExpiryRandom();
+    testCallbacks();
+
+    return testResult();
+}